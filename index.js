@@ -16,7 +16,7 @@ process.on('uncaughtException', (err) => {
 
 const nativeJsh = require("native-jsh");
 const nativeIpc = require("native-ipc");
-const native = nativeJsh.init();
+const native = nativeJsh.init({ readers: parseInt(process.env.JSH_READERS) || undefined, zygote: !!process.env.JSH_ZYGOTE });
 const homedir = require('homedir')();
 
 (() => {
@@ -58,6 +58,9 @@ module.exports = {
         const jconsole = require("./console");
         const completions = require("./completions");
         const jobcontrol = require("./jobcontrol");
+        const native = require("native-jsh");
+        // run natively in place of a process, see Builtin.h
+        const nativeBuiltins = new Set(native.builtins());
         commands.add("eval", eval);
         commands.add("exit", exit);
         commands.add("cd", (jsh, dir) => {
@@ -76,6 +79,32 @@ module.exports = {
         });
         commands.add("pwd", process.cwd);
         commands.add("rehash", jconsole.rehash);
+        commands.add("which", (jsh, ...names) => {
+            let out = [];
+            for (let idx = 0; idx < names.length; ++idx) {
+                let name = names[idx];
+                if (commands.find(name) || nativeBuiltins.has(name)) {
+                    out.push(`${name}: shell built-in command`);
+                    continue;
+                }
+                let file = native.which(name, jsh.shell.env.PATH || "");
+                out.push(file || `${name} not found`);
+            }
+            return out.join("\n");
+        });
+        commands.add("type", (jsh, ...names) => {
+            let out = [];
+            for (let idx = 0; idx < names.length; ++idx) {
+                let name = names[idx];
+                if (commands.find(name) || nativeBuiltins.has(name)) {
+                    out.push(`${name} is a shell builtin`);
+                    continue;
+                }
+                let file = native.which(name, jsh.shell.env.PATH || "");
+                out.push(file ? `${name} is ${file}` : `${name}: not found`);
+            }
+            return out.join("\n");
+        });
         commands.add("jobs", jobcontrol.jobs);
         commands.add("fg", undefined, undefined, jobcontrol.fg);
         commands.add("bg", undefined, undefined, jobcontrol.bg);
@@ -2,8 +2,8 @@
 
 const CommandBase = require("./commandbase");
 const jshcommands = require("../commands");
-const child_process = require("child_process");
 const ScriptJob = require("./scriptjob");
+const output = require("./output");
 const native = require("native-jsh");
 const Job = native.Job;
 
@@ -61,16 +61,6 @@ class CommandExpander extends CommandBase {
                 throw `CommandExpander with ${len} commands not supported`;
             }
 
-            let env = (cmd) => {
-                let ce = cmd.assigns || {};
-                let se = jsh.shell.env;
-                for (var k in se) {
-                    if (!(k in ce))
-                        ce[k] = se[k];
-                }
-                return ce;
-            };
-
             let cmd = this.commands[0];
             let jscmd;
             if ((jscmd = jshcommands.find(cmd.name))) {
@@ -97,26 +87,36 @@ class CommandExpander extends CommandBase {
                 });
                 jsjob.start(Job.Background);
             } else {
-                let proc = child_process.spawn(cmd.name, cmd.args, { env: env(cmd), encoding: "utf8" });
+                // the job keeps all of stdout natively and hands it
+                // over in one piece, newlines already trimmed
+                let job = new Job();
+                // our callbacks reference this, not the job, so hold on to it
+                this.job = job;
+                job.add({ path: cmd.name, args: cmd.args, environ: jsh.shell.environ, assigns: cmd.assigns, redirs: cmd.redirs });
                 let o = {
                     out: "",
                     err: ""
                 };
-                proc.stdout.on("data", (out) => {
-                    o.out += out;
-                });
-                proc.stderr.on("data", (err) => {
-                    o.err += err;
+                job.on("stdout", (out) => {
+                    o.out = out.toString("utf8");
                 });
-                proc.on("close", (status) => {
-                    this.stdout = truncnl(o.out);
-                    this.stderr = o.err;
-                    this.status = status;
-                    resolve();
+                job.on("stderr", (err) => {
+                    o.err += output.toString(err);
                 });
-                proc.on("error", (err) => {
-                    reject(err);
+                job.on("stateChanged", (state, status, error) => {
+                    if (state == Job.Terminated) {
+                        this.job = undefined;
+                        this.stdout = o.out;
+                        this.stderr = o.err;
+                        // exit code like child_process, null if signaled
+                        this.status = (status & 0x7f) ? null : (status >> 8) & 0xff;
+                        resolve();
+                    } else if (state == Job.Failed) {
+                        this.job = undefined;
+                        reject(new Error(error || `${cmd.name}: command failed`));
+                    }
                 });
+                job.start(Job.Background, Job.CaptureStdout | Job.CaptureTrimNewlines | Job.DupStderr);
             }
         });
         return promise;
@@ -8,19 +8,10 @@ const jobcontrol = require("../jobcontrol");
 
 const CommandBase = require("./commandbase");
 const ScriptJob = require("./scriptjob");
+const output = require("./output");
 
 class CommandPipeline extends CommandBase {
     run(jsh, asyncOverride, io) {
-        let env = (cmd) => {
-            let ce = cmd.assigns || {};
-            let se = jsh.shell.env;
-            for (var k in se) {
-                if (!(k in ce))
-                    ce[k] = se[k];
-            }
-            return ce;
-        };
-
         let Mode = { Native: 0, JS: 1 };
         let mode = undefined;
         let cmds = this.commands.slice();
@@ -37,13 +28,15 @@ class CommandPipeline extends CommandBase {
         let job = undefined;
         let jscmd;
 
+        // only called when switching between a script job and a native
+        // one, consecutive native commands all go in the same job
         let chain = (oldjob, newjob) => {
             job.on("stateChanged", (state) => {
                 // console.log("closing");
                 newjob.close();
             });
-            oldjob.on("stdout", (buf) => { newjob.write(buf); });
-            //oldjob.on("stderr", (buf) => { io ? io.stderr(buf.toString("utf8")) : readline.error(buf.toString("utf8")); });
+            oldjob.on("stdout", (buf) => { output.forEach(buf, (b) => { newjob.write(b); }); });
+            //oldjob.on("stderr", (buf) => { io ? io.stderr(output.toString(buf)) : readline.error(output.toString(buf)); });
         };
 
         let length = 1;
@@ -89,7 +82,7 @@ class CommandPipeline extends CommandBase {
                         jobcontrol.add(job);
                     job = newjob;
                 }
-                job.add({ path: cmd.name, args: cmd.args, environ: env(cmd), redirs: cmd.redirs });
+                job.add({ path: cmd.name, args: cmd.args, environ: jsh.shell.environ, assigns: cmd.assigns, redirs: cmd.redirs });
             }
         }
 
@@ -97,7 +90,7 @@ class CommandPipeline extends CommandBase {
             return;
 
         // and then finally we need to start the last job chain
-        job.on("stateChanged", (state, status) => {
+        job.on("stateChanged", (state, status, error) => {
             if (state == Job.Terminated
                 || state == Job.Failed) {
                 this.status = (state == Job.Terminated) ? status : undefined;
@@ -105,7 +98,7 @@ class CommandPipeline extends CommandBase {
                     native.restore();
                     readline.resume(() => {
                         if (state == Job.Failed)
-                            console.log("command failed");
+                            console.log(error || "command failed");
                         if (!detached)
                             jsh.shell.lastStatus = this.status;
                         this._notify();
@@ -113,9 +106,9 @@ class CommandPipeline extends CommandBase {
                 } else {
                     if (state == Job.Failed) {
                         if (io)
-                            io.stderr("command failed");
+                            io.stderr(error || "command failed");
                         else
-                            console.log("command failed");
+                            console.log(error || "command failed");
                     }
                     if (io && io.close) {
                         io.close(status);
@@ -129,16 +122,16 @@ class CommandPipeline extends CommandBase {
         if (async) {
             job.on("stdout", (buf) => {
                 if (io) {
-                    io.stdout(buf.toString("utf8"));
+                    io.stdout(output.toString(buf));
                 } else {
-                    readline.log(buf.toString("utf8"));
+                    readline.log(output.toString(buf));
                 }
             });
             job.on("stderr", (buf) => {
                 if (io) {
-                    io.stderr(buf.toString("utf8"));
+                    io.stderr(output.toString(buf));
                 } else {
-                    readline.error(buf.toString("utf8"));
+                    readline.error(output.toString(buf));
                 }
             });
             job.start(Job.Background, Job.DupStdin);
@@ -150,13 +143,13 @@ class CommandPipeline extends CommandBase {
                 if (io.stdout) {
                     dups |= Job.DupStdout;
                     job.on("stdout", (buf) => {
-                        io.stdout(buf.toString("utf8"));
+                        io.stdout(output.toString(buf));
                     });
                 }
                 if (io.stderr) {
                     dups |= Job.DupStderr;
                     job.on("stderr", (buf) => {
-                        io.stderr(buf.toString("utf8"));
+                        io.stderr(output.toString(buf));
                     });
                 }
                 if (io.close) {
@@ -8,21 +8,12 @@ const jobcontrol = require("../jobcontrol");
 
 const CommandBase = require("./commandbase");
 const ScriptJob = require("./scriptjob");
+const output = require("./output");
 
 class CommandRunner extends CommandBase {
     run(jsh) {
         this.setVariables(jsh);
 
-        let env = (cmd) => {
-            let ce = cmd.assigns || {};
-            let se = jsh.shell.env;
-            for (var k in se) {
-                if (!(k in ce))
-                    ce[k] = se[k];
-            }
-            return ce;
-        };
-
         var jscmd;
         let io = undefined;
         let asyncOverride = false;
@@ -43,20 +34,20 @@ class CommandRunner extends CommandBase {
                     job.add({ command: cmd, script: jscmd });
                 } else {
                     job = new Job();
-                    job.add({ path: cmd.name, args: cmd.args, environ: env(cmd), redirs: cmd.redirs });
+                    job.add({ path: cmd.name, args: cmd.args, environ: jsh.shell.environ, assigns: cmd.assigns, redirs: cmd.redirs });
                 }
                 if (cmd.async || asyncOverride) {
                     job.on("stdout", (buf) => {
                         if (io)
-                            io.stdout(buf.toString("utf8"));
+                            io.stdout(output.toString(buf));
                         else
-                            readline.log(buf.toString("utf8"));
+                            readline.log(output.toString(buf));
                     });
                     job.on("stderr", (buf) => {
                         if (io)
-                            io.stderr(buf.toString("utf8"));
+                            io.stderr(output.toString(buf));
                         else
-                            readline.error(buf.toString("utf8"));
+                            readline.error(output.toString(buf));
                     });
                     if (i == len - 1 && io && io.close) {
                         job.on("stateChanged", (state, status) => {
@@ -74,13 +65,13 @@ class CommandRunner extends CommandBase {
                         if (io.stdout) {
                             dups |= Job.DupStdout;
                             job.on("stdout", (buf) => {
-                                io.stdout(buf.toString("utf8"));
+                                io.stdout(output.toString(buf));
                             });
                         }
                         if (io.stderr) {
                             dups |= Job.DupStderr;
                             job.on("stderr", (buf) => {
-                                io.stderr(buf.toString("utf8"));
+                                io.stderr(output.toString(buf));
                             });
                         }
                         if (i == len - 1 && io.close) {
@@ -103,14 +94,14 @@ class CommandRunner extends CommandBase {
         let next = () => {
             let n = r.next();
             if (!n.done) {
-                n.value.job.on("stateChanged", (state, status) => {
+                n.value.job.on("stateChanged", (state, status, error) => {
                     if (state == Job.Terminated
                         || state == Job.Failed) {
                         // we're really only interested in the status of the final command
                         native.restore();
                         readline.resume(() => {
                             if (state == Job.Failed)
-                                console.log("command failed");
+                                console.log(error || "command failed");
                             if (n.value.idx == len - 1) {
                                 this.status = (state == Job.Terminated) ? status : undefined;
                                 if (!detached)
@@ -0,0 +1,23 @@
+/*global module,Buffer*/
+
+// native jobs deliver their output as a Buffer, or as an array
+// of Buffers when more than one chunk was queued up
+
+function toString(data)
+{
+    if (data instanceof Array)
+        return Buffer.concat(data).toString("utf8");
+    return data.toString("utf8");
+}
+
+function forEach(data, cb)
+{
+    if (data instanceof Array) {
+        for (let i = 0; i < data.length; ++i)
+            cb(data[i]);
+    } else {
+        cb(data);
+    }
+}
+
+module.exports = { toString: toString, forEach: forEach };
@@ -53,6 +53,8 @@ function redirects(redirs, io)
             }
             if ("io" in redir)
                 infd = redir.io;
+            if (redir.op[0] == "<")
+                throw `Can only redirect stdout and stderr for JS functions, ${redir.op}`;
             switch (redir.op) {
             case ">&":
                 out = parseInt(redir.file);
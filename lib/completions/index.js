@@ -214,25 +214,6 @@ const state = {
         });
     },
 
-    updateExe: function updateExe(exe) {
-        fs.readdir(exe, (err, files) => {
-            // check if file is executable
-            if (err)
-                return;
-            for (let idx = 0; idx < files.length; ++idx) {
-                let fn = files[idx];
-                fs.stat(path.join(exe, fn), (err, stats) => {
-                    if (err)
-                        return;
-                    if (stats.isFile() && isExe(stats)) {
-                        // console.log(`updating ${fn}`);
-                        state.execache.add(fn);
-                    }
-                });
-            }
-        });
-    },
-
     dirComplete: function dirComplete(data, tokens, cb, opts) {
         if (!tokens.tokens.length || tokens.cursor.token === undefined && !opts.rel) {
             cb();
@@ -555,10 +536,11 @@ const completions = {
             for (idx = 0; idx < cmds.length; ++idx) {
                 state.execache.add(cmds[idx]);
             }
-            // insert executable files in PATH
-            let dirs = arg.split(':');
-            for (idx = 0; idx < dirs.length; ++idx) {
-                state.updateExe(dirs[idx]);
+            // insert executable files in PATH, the native command
+            // hash has them and keeps itself up to date
+            let exes = nativeJsh.commands(arg);
+            for (idx = 0; idx < exes.length; ++idx) {
+                state.execache.add(exes[idx]);
             }
             break;
         case completions.DIR:
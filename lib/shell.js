@@ -108,10 +108,27 @@ class Shell extends EventEmitter
 
         this.generator = new CodeGenerator();
 
-        this.env = {};
+        // the native copy is what jobs are started with, keep it in
+        // sync so that it never has to be rebuilt from scratch
+        const env = {};
         for (let k in process.env) {
-            this.env[k] = process.env[k];
+            env[k] = process.env[k];
         }
+        this.environ = new nativeJsh.Environ(env);
+        this.env = new Proxy(env, {
+            set: (target, key, value) => {
+                target[key] = value;
+                if (typeof key === "string")
+                    this.environ.set(key, "" + value);
+                return true;
+            },
+            deleteProperty: (target, key) => {
+                delete target[key];
+                if (typeof key === "string")
+                    this.environ.unset(key);
+                return true;
+            }
+        });
         this.vars = {};
 
         this.user = require("username").sync();
@@ -135,6 +152,9 @@ class Shell extends EventEmitter
 
     rehash() {
         this.users = undefined;
+        // the command hash watches PATH by itself, this is
+        // for when it can't tell, like a remounted directory
+        nativeJsh.rehash();
     }
 
     get environment() {
@@ -0,0 +1,105 @@
+#include "Buffer.h"
+#include "utils.h"
+#include <algorithm>
+#include <sys/uio.h>
+
+enum { MaxPooled = 256 };
+
+struct {
+    Mutex mutex;
+    std::vector<Slab*> pool;
+
+    std::atomic<uint64_t> allocated, freed, reused;
+} static state;
+
+Slab* Slab::create()
+{
+    {
+        MutexLocker locker(&state.mutex);
+        if (!state.pool.empty()) {
+            Slab* slab = state.pool.back();
+            state.pool.pop_back();
+            state.reused.fetch_add(1, std::memory_order_relaxed);
+            slab->mRef.store(1, std::memory_order_relaxed);
+            return slab;
+        }
+    }
+    state.allocated.fetch_add(1, std::memory_order_relaxed);
+    return new Slab;
+}
+
+void Slab::recycle(Slab* slab)
+{
+    {
+        MutexLocker locker(&state.mutex);
+        if (state.pool.size() < MaxPooled) {
+            if (state.pool.capacity() < MaxPooled)
+                state.pool.reserve(MaxPooled);
+            state.pool.push_back(slab);
+            return;
+        }
+    }
+    state.freed.fetch_add(1, std::memory_order_relaxed);
+    delete slab;
+}
+
+Slab::Stats Slab::stats()
+{
+    Stats stats;
+    stats.allocated = state.allocated.load(std::memory_order_relaxed);
+    stats.freed = state.freed.load(std::memory_order_relaxed);
+    stats.reused = state.reused.load(std::memory_order_relaxed);
+    {
+        MutexLocker locker(&state.mutex);
+        stats.pooled = state.pool.size();
+    }
+    return stats;
+}
+
+ssize_t Buffer::readFrom(int fd, Cursor& cursor, size_t max)
+{
+    if (cursor.slab && cursor.used == Slab::Size)
+        cursor.slab.reset();
+
+    // fill whatever is left of the cursor slab first, then a fresh one
+    iovec iov[2];
+    int iovcnt = 0;
+    size_t first = 0;
+    if (cursor.slab) {
+        first = std::min<size_t>(Slab::Size - cursor.used, max);
+        iov[iovcnt].iov_base = cursor.slab->data() + cursor.used;
+        iov[iovcnt].iov_len = first;
+        ++iovcnt;
+    }
+    SlabRef fresh;
+    if (first < max) {
+        fresh = SlabRef(Slab::create());
+        iov[iovcnt].iov_base = fresh->data();
+        iov[iovcnt].iov_len = std::min<size_t>(Slab::Size, max - first);
+        ++iovcnt;
+    }
+
+    ssize_t e;
+    EINTRWRAP(e, ::readv(fd, iov, iovcnt));
+    if (e <= 0) {
+        // giving the slab back must not clobber errno for the caller
+        const int err = errno;
+        fresh.reset();
+        errno = err;
+        return e;
+    }
+
+    const size_t n = static_cast<size_t>(e);
+    if (first) {
+        const size_t c = std::min(n, first);
+        add(Chunk { cursor.slab, cursor.used, c });
+        cursor.used += c;
+    }
+    if (n > first) {
+        add(Chunk { fresh, 0, n - first });
+        cursor.slab = std::move(fresh);
+        cursor.used = n - first;
+    }
+    // an unused fresh slab goes straight back to the pool
+    return e;
+}
@@ -2,107 +2,302 @@
 #define BUFFER_H
 
 #include <vector>
-#include <queue>
+#include <atomic>
+#include <limits>
+#include <assert.h>
+#include <string.h>
+#include <sys/types.h>
+
+// fixed size, refcounted block of memory. slabs come from a process wide
+// pool and go back to it when the last reference is dropped, so in the
+// steady state reading job output does not allocate
+class Slab
+{
+public:
+    enum { Size = 65536 };
+
+    static Slab* create();
+
+    void ref() { mRef.fetch_add(1, std::memory_order_relaxed); }
+    void deref()
+    {
+        if (mRef.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            recycle(this);
+    }
+    bool isShared() const { return mRef.load(std::memory_order_acquire) > 1; }
+
+    uint8_t* data() { return mData; }
+    const uint8_t* data() const { return mData; }
+
+    struct Stats
+    {
+        uint64_t allocated, freed, reused;
+        size_t pooled;
+    };
+    static Stats stats();
+
+private:
+    Slab() : mRef(1) { }
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+
+    static void recycle(Slab* slab);
+
+    std::atomic<int> mRef;
+    uint8_t mData[Size];
+};
+
+// owning reference to a slab
+class SlabRef
+{
+public:
+    SlabRef() : mSlab(0) { }
+    explicit SlabRef(Slab* slab) : mSlab(slab) { }  // adopts the reference
+    SlabRef(const SlabRef& other) : mSlab(other.mSlab) { if (mSlab) mSlab->ref(); }
+    SlabRef(SlabRef&& other) : mSlab(other.mSlab) { other.mSlab = 0; }
+    ~SlabRef() { if (mSlab) mSlab->deref(); }
+
+    SlabRef& operator=(const SlabRef& other)
+    {
+        if (other.mSlab)
+            other.mSlab->ref();
+        if (mSlab)
+            mSlab->deref();
+        mSlab = other.mSlab;
+        return *this;
+    }
+    SlabRef& operator=(SlabRef&& other)
+    {
+        if (this != &other) {
+            if (mSlab)
+                mSlab->deref();
+            mSlab = other.mSlab;
+            other.mSlab = 0;
+        }
+        return *this;
+    }
+
+    void reset() { if (mSlab) mSlab->deref(); mSlab = 0; }
+    Slab* release() { Slab* s = mSlab; mSlab = 0; return s; }
+
+    Slab* get() const { return mSlab; }
+    Slab* operator->() const { return mSlab; }
+    explicit operator bool() const { return mSlab != 0; }
+
+private:
+    Slab* mSlab;
+};
 
 class Buffer
 {
 public:
     typedef std::vector<uint8_t> Data;
 
-    Buffer() : mSize(0), mOffset(0) { }
+    // a slice of a slab
+    struct Chunk
+    {
+        SlabRef slab;
+        size_t offset, size;
+
+        uint8_t* data() const { return slab->data() + offset; }
+    };
+
+    // the partially filled slab left over from the previous readFrom()
+    // on the same fd, small reads keep filling it up instead of each
+    // taking a slab of their own
+    struct Cursor
+    {
+        Cursor() : used(0) { }
+
+        SlabRef slab;
+        size_t used;
+    };
+
+    Buffer() : mSize(0), mFront(0) { }
     Buffer(Buffer&& other)
-        : mSize(other.mSize), mOffset(other.mOffset), mDatas(std::move(other.mDatas))
+        : mSize(other.mSize), mFront(other.mFront), mChunks(std::move(other.mChunks))
     {
+        other.mSize = other.mFront = 0;
     }
     ~Buffer() { }
 
     Buffer& operator=(Buffer&& other)
     {
         mSize = other.mSize;
-        mOffset = other.mOffset;
-        mDatas = std::move(other.mDatas);
+        mFront = other.mFront;
+        mChunks = std::move(other.mChunks);
+        other.mSize = other.mFront = 0;
         return *this;
     }
 
-    void add(Data&& data);
     void add(const uint8_t* data, size_t len);
+    void add(Chunk&& chunk);
+
+    // readv() from fd straight into slabs, at most max bytes.
+    // returns whatever readv() returned
+    ssize_t readFrom(int fd, Cursor& cursor, size_t max = std::numeric_limits<size_t>::max());
 
     size_t size() const { return mSize; }
     bool empty() const { return !mSize; }
 
+    size_t chunkCount() const { return mChunks.size() - mFront; }
+    // hands the first chunk over to the caller
+    Chunk takeChunk();
+    // moves the first len bytes into a buffer of their own, chunks
+    // that straddle the split share the slab
+    Buffer split(size_t len);
+
+    // drops trailing ch bytes
+    void trimEnd(uint8_t ch);
+
+    enum { npos = static_cast<size_t>(-1) };
+    // offset of the last occurrence of ch, scanning back from the end
+    size_t lastIndexOf(uint8_t ch) const;
+
     size_t read(uint8_t* data, size_t len);
     Data readAll();
 
-    void clear() { mSize = mOffset = 0; while (!mDatas.empty()) mDatas.pop(); }
+    void clear() { mSize = mFront = 0; mChunks.clear(); }
 
 private:
     Buffer(const Buffer&) = delete;
     Buffer& operator=(const Buffer&) = delete;
 
-    size_t mSize, mOffset;
-    std::queue<Data> mDatas;
+    size_t mSize, mFront;
+    std::vector<Chunk> mChunks;
 };
 
-inline void Buffer::add(Data&& data)
+inline void Buffer::add(Chunk&& chunk)
 {
-    mSize += data.size();
-    mDatas.push(std::forward<Data>(data));
+    if (!chunk.size)
+        return;
+    mSize += chunk.size;
+    if (mChunks.size() > mFront) {
+        // consecutive reads into the same slab end up as one chunk
+        Chunk& last = mChunks.back();
+        if (last.slab.get() == chunk.slab.get() && last.offset + last.size == chunk.offset) {
+            last.size += chunk.size;
+            return;
+        }
+    }
+    mChunks.push_back(std::move(chunk));
+}
+
+inline Buffer::Chunk Buffer::takeChunk()
+{
+    assert(mFront < mChunks.size());
+    Chunk chunk = std::move(mChunks[mFront++]);
+    mSize -= chunk.size;
+    if (mFront == mChunks.size()) {
+        mChunks.clear();
+        mFront = 0;
+    }
+    return chunk;
 }
 
 inline void Buffer::add(const uint8_t* data, size_t len)
 {
-    Data d(len);
-    memcpy(&d[0], data, len);
-    mDatas.push(std::move(d));
     mSize += len;
+    if (mChunks.size() > mFront) {
+        // fill up our last slab if no one else is looking at it
+        Chunk& last = mChunks.back();
+        const size_t end = last.offset + last.size;
+        if (end < Slab::Size && !last.slab->isShared()) {
+            const size_t n = std::min<size_t>(Slab::Size - end, len);
+            memcpy(last.slab->data() + end, data, n);
+            last.size += n;
+            data += n;
+            len -= n;
+        }
+    }
+    while (len > 0) {
+        const size_t n = std::min<size_t>(Slab::Size, len);
+        Chunk chunk = { SlabRef(Slab::create()), 0, n };
+        memcpy(chunk.data(), data, n);
+        mChunks.push_back(std::move(chunk));
+        data += n;
+        len -= n;
+    }
 }
 
-inline size_t Buffer::read(uint8_t* data, size_t len)
+inline Buffer Buffer::split(size_t len)
 {
-    size_t rem = len;
-    size_t rd = 0;
-    for (;;) {
-        if (mDatas.empty()) {
-            assert(mSize >= rd);
-            mSize -= rd;
-            return rd;
+    assert(len <= mSize);
+    Buffer head;
+    while (len > 0) {
+        Chunk& front = mChunks[mFront];
+        if (front.size <= len) {
+            len -= front.size;
+            head.add(takeChunk());
+            continue;
         }
-        auto front = mDatas.front();
-        if (front.size() - mOffset >= rem) {
-            // read rem bytes, increase mOffset so we start
-            // at that point the next time read() is called
-            memcpy(data + rd, &front[0] + mOffset, rem);
-            mOffset += rem;
-            if (mOffset == front.size()) {
-                mDatas.pop();
-                mOffset = 0;
-            }
-            assert(mSize >= rd + rem);
-            mSize -= rd + rem;
-            return rd + rem;
-        } else {
-            // read the entire data, decrease rem
-            memcpy(data + rd, &front[0] + mOffset, front.size() - mOffset);
-            mOffset = 0;
-            rd += front.size() - mOffset;
-            rem -= front.size() - mOffset;
-            mDatas.pop();
+        head.add(Chunk { front.slab, front.offset, len });
+        front.offset += len;
+        front.size -= len;
+        mSize -= len;
+        break;
+    }
+    return head;
+}
+
+inline void Buffer::trimEnd(uint8_t ch)
+{
+    while (mChunks.size() > mFront) {
+        Chunk& last = mChunks.back();
+        while (last.size && last.data()[last.size - 1] == ch) {
+            --last.size;
+            --mSize;
         }
+        if (last.size)
+            return;
+        mChunks.pop_back();
     }
+    mChunks.clear();
+    mFront = 0;
 }
 
-inline Buffer::Data Buffer::readAll()
+inline size_t Buffer::lastIndexOf(uint8_t ch) const
 {
-    if (mDatas.size() == 1 && !mOffset) {
-        // optimized case
-        Data d = std::move(mDatas.front());
-        mDatas.pop();
-        mSize = 0;
-        return d;
+    size_t end = mSize;
+    for (size_t i = mChunks.size(); i > mFront; --i) {
+        const Chunk& chunk = mChunks[i - 1];
+        end -= chunk.size;
+        if (const void* found = memrchr(chunk.data(), ch, chunk.size))
+            return end + (static_cast<const uint8_t*>(found) - chunk.data());
     }
+    return npos;
+}
 
+inline size_t Buffer::read(uint8_t* data, size_t len)
+{
+    size_t rd = 0;
+    while (rd < len && mFront < mChunks.size()) {
+        Chunk& front = mChunks[mFront];
+        const size_t n = std::min(front.size, len - rd);
+        memcpy(data + rd, front.data(), n);
+        rd += n;
+        front.offset += n;
+        front.size -= n;
+        if (!front.size) {
+            // done with this one, let the slab go now rather than later
+            front.slab.reset();
+            ++mFront;
+        }
+    }
+    assert(mSize >= rd);
+    mSize -= rd;
+    if (mFront == mChunks.size()) {
+        mChunks.clear();
+        mFront = 0;
+    }
+    return rd;
+}
+
+inline Buffer::Data Buffer::readAll()
+{
     Data d(mSize);
-    read(&d[0], mSize);
+    if (!d.empty())
+        read(&d[0], mSize);
     return d;
 }
 
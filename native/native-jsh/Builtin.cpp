@@ -0,0 +1,699 @@
+#include "Builtin.h"
+#include "utils.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// one character or backslash escape at pos, for echo -e, printf's format
+// and %b. \c ends all output, false is returned for that. echo and %b
+// want \0nnn for octal, the format takes \nnn
+static bool unescape(const std::string& str, size_t& pos, std::string& out, bool zeroOctal)
+{
+    const size_t size = str.size();
+    const char c = str[pos++];
+    if (c != '\\' || pos == size) {
+        out += c;
+        return true;
+    }
+    const char e = str[pos++];
+    switch (e) {
+    case 'a': out += '\a'; break;
+    case 'b': out += '\b'; break;
+    case 'e': case 'E': out += '\033'; break;
+    case 'f': out += '\f'; break;
+    case 'n': out += '\n'; break;
+    case 'r': out += '\r'; break;
+    case 't': out += '\t'; break;
+    case 'v': out += '\v'; break;
+    case '\\': out += '\\'; break;
+    case 'c':
+        return false;
+    case 'x': {
+        int val = 0, digits = 0;
+        while (digits < 2 && pos < size && isxdigit(static_cast<unsigned char>(str[pos]))) {
+            const char h = str[pos++];
+            val = val * 16 + (isdigit(static_cast<unsigned char>(h)) ? h - '0' : (tolower(h) - 'a' + 10));
+            ++digits;
+        }
+        if (!digits)
+            out += "\\x";
+        else
+            out += static_cast<char>(val);
+        break; }
+    default:
+        if (e >= '0' && e <= '7' && (!zeroOctal || e == '0')) {
+            int val = zeroOctal ? 0 : e - '0', digits = zeroOctal ? 0 : 1;
+            while (digits < 3 && pos < size && str[pos] >= '0' && str[pos] <= '7') {
+                val = val * 8 + (str[pos++] - '0');
+                ++digits;
+            }
+            out += static_cast<char>(val & 0xff);
+        } else {
+            out += '\\';
+            out += e;
+        }
+        break;
+    }
+    return true;
+}
+
+static bool unescapeAll(const std::string& str, std::string& out)
+{
+    size_t pos = 0;
+    while (pos < str.size()) {
+        if (!unescape(str, pos, out, true))
+            return false;
+    }
+    return true;
+}
+
+static int builtinTrue(Builtin::Context&)
+{
+    return 0;
+}
+
+static int builtinFalse(Builtin::Context&)
+{
+    return 1;
+}
+
+static int builtinEcho(Builtin::Context& ctx)
+{
+    const auto& args = *ctx.args;
+    bool newline = true, escapes = false;
+    size_t idx = 0;
+    // options only count if every letter is one we know
+    for (; idx < args.size(); ++idx) {
+        const std::string& arg = args[idx];
+        if (arg.size() < 2 || arg[0] != '-' || arg.find_first_not_of("neE", 1) != std::string::npos)
+            break;
+        for (size_t i = 1; i < arg.size(); ++i) {
+            switch (arg[i]) {
+            case 'n': newline = false; break;
+            case 'e': escapes = true; break;
+            case 'E': escapes = false; break;
+            }
+        }
+    }
+    for (size_t first = idx; idx < args.size(); ++idx) {
+        if (idx > first)
+            ctx.out += ' ';
+        if (!escapes) {
+            ctx.out += args[idx];
+            continue;
+        }
+        if (!unescapeAll(args[idx], ctx.out))
+            return 0;
+    }
+    if (newline)
+        ctx.out += '\n';
+    return 0;
+}
+
+template<typename T>
+static void format(std::string& out, const std::string& spec, T value)
+{
+    char buf[128];
+    const int n = snprintf(buf, sizeof(buf), spec.c_str(), value);
+    if (n < 0)
+        return;
+    if (static_cast<size_t>(n) < sizeof(buf)) {
+        out.append(buf, n);
+        return;
+    }
+    std::vector<char> big(n + 1);
+    snprintf(big.data(), big.size(), spec.c_str(), value);
+    out.append(big.data(), n);
+}
+
+// widths and precisions past this make output that no pipe takes in one
+// go anyway, the real printf gets those before we allocate any of it
+enum { MaxFieldWidth = 64 * 1024 };
+
+static int builtinPrintf(Builtin::Context& ctx)
+{
+    const auto& args = *ctx.args;
+    size_t idx = 0;
+    if (idx < args.size() && args[idx] == "--")
+        ++idx;
+    if (idx == args.size()) {
+        ctx.err += ctx.name + ": usage: printf format [arguments]\n";
+        return 2;
+    }
+    const std::string& fmt = args[idx++];
+    int ret = 0;
+
+    auto next = [&]() -> const std::string* {
+        return idx < args.size() ? &args[idx++] : 0;
+    };
+    // numbers may also be given as a quote followed by a character
+    auto number = [](const std::string* arg) -> const char* {
+        if (!arg || arg->empty())
+            return "0";
+        if ((*arg)[0] == '\'' || (*arg)[0] == '"')
+            return 0;
+        return arg->c_str();
+    };
+    auto invalid = [&](const std::string& arg) {
+        ctx.err += ctx.name + ": " + arg + ": invalid number\n";
+        ret = 1;
+    };
+    auto integer = [&](const std::string* arg) -> long long {
+        const char* str = number(arg);
+        if (!str)
+            return arg->size() > 1 ? static_cast<unsigned char>((*arg)[1]) : 0;
+        char* end;
+        errno = 0;
+        const long long val = strtoll(str, &end, 0);
+        if (end == str || *end || errno)
+            invalid(*arg);
+        return val;
+    };
+    auto uinteger = [&](const std::string* arg) -> unsigned long long {
+        const char* str = number(arg);
+        if (!str)
+            return arg->size() > 1 ? static_cast<unsigned char>((*arg)[1]) : 0;
+        char* end;
+        errno = 0;
+        const unsigned long long val = strtoull(str, &end, 0);
+        if (end == str || *end || errno)
+            invalid(*arg);
+        return val;
+    };
+    auto floating = [&](const std::string* arg) -> long double {
+        const char* str = number(arg);
+        if (!str)
+            return arg->size() > 1 ? static_cast<unsigned char>((*arg)[1]) : 0;
+        char* end;
+        const long double val = strtold(str, &end);
+        if (end == str || *end)
+            invalid(*arg);
+        return val;
+    };
+
+    // the format is reused for as long as there are arguments left
+    for (;;) {
+        const size_t before = idx;
+        size_t pos = 0;
+        while (pos < fmt.size()) {
+            const char c = fmt[pos];
+            if (c == '\\') {
+                if (!unescape(fmt, pos, ctx.out, false))
+                    return ret;
+                continue;
+            }
+            if (c != '%') {
+                ctx.out += c;
+                ++pos;
+                continue;
+            }
+            if (pos + 1 < fmt.size() && fmt[pos + 1] == '%') {
+                ctx.out += '%';
+                pos += 2;
+                continue;
+            }
+
+            std::string spec = "%";
+            ++pos;
+            while (pos < fmt.size() && strchr("-+ #0", fmt[pos]))
+                spec += fmt[pos++];
+            // false if it's too wide
+            auto width = [&]() {
+                long long value;
+                if (pos < fmt.size() && fmt[pos] == '*') {
+                    ++pos;
+                    value = integer(next());
+                } else {
+                    const size_t start = pos;
+                    while (pos < fmt.size() && isdigit(static_cast<unsigned char>(fmt[pos])))
+                        ++pos;
+                    if (pos == start)
+                        return true;
+                    if (pos - start > 6)
+                        return false;
+                    value = atoll(fmt.c_str() + start);
+                }
+                if (value > MaxFieldWidth || value < -MaxFieldWidth)
+                    return false;
+                spec += std::to_string(value);
+                return true;
+            };
+            if (!width())
+                return Builtin::Unsupported;
+            if (pos < fmt.size() && fmt[pos] == '.') {
+                spec += fmt[pos++];
+                if (!width())
+                    return Builtin::Unsupported;
+            }
+            if (pos == fmt.size()) {
+                ctx.err += ctx.name + ": " + spec + ": missing format character\n";
+                return 1;
+            }
+            const char conv = fmt[pos++];
+            switch (conv) {
+            case 'd':
+            case 'i':
+                format(ctx.out, spec + "ll" + conv, integer(next()));
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                format(ctx.out, spec + "ll" + conv, uinteger(next()));
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                format(ctx.out, spec + 'L' + conv, floating(next()));
+                break;
+            case 'c': {
+                const std::string* arg = next();
+                const std::string chr = (arg && !arg->empty()) ? arg->substr(0, 1) : std::string();
+                format(ctx.out, spec + 's', chr.c_str());
+                break; }
+            case 's': {
+                const std::string* arg = next();
+                format(ctx.out, spec + 's', arg ? arg->c_str() : "");
+                break; }
+            case 'b': {
+                const std::string* arg = next();
+                std::string str;
+                const bool more = !arg || unescapeAll(*arg, str);
+                format(ctx.out, spec + 's', str.c_str());
+                if (!more)
+                    return ret;
+                break; }
+            default:
+                return Builtin::Unsupported;
+            }
+        }
+        if (idx == before || idx >= args.size())
+            break;
+    }
+    return ret;
+}
+
+namespace {
+
+// test and [, as specified by posix. 0 to 4 arguments are decided by
+// their count, more than that are parsed as an expression with
+// !, -a, -o and parentheses
+class Test
+{
+public:
+    Test(Builtin::Context& ctx, size_t end)
+        : mCtx(ctx), mArgs(*ctx.args), mPos(0), mEnd(end)
+    {
+    }
+
+    int run();
+
+private:
+    bool args(size_t count);
+    bool orExpr();
+    bool andExpr();
+    bool notExpr();
+    bool primary();
+
+    bool unary(const std::string& op, const std::string& arg);
+    bool binary(const std::string& left, const std::string& op, const std::string& right);
+    long long integer(const std::string& arg);
+
+    static bool isUnary(const std::string& op);
+    static bool isBinary(const std::string& op);
+
+    void error(const std::string& msg)
+    {
+        if (mError.empty())
+            mError = msg;
+    }
+
+    Builtin::Context& mCtx;
+    const Process::Args& mArgs;
+    size_t mPos, mEnd;
+    std::string mError;
+};
+
+}
+
+bool Test::isUnary(const std::string& op)
+{
+    return op.size() == 2 && op[0] == '-' && strchr("bcdefgGhLknOprsStuwxz", op[1]);
+}
+
+bool Test::isBinary(const std::string& op)
+{
+    static const char* ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", 0
+    };
+    for (const char** cur = ops; *cur; ++cur) {
+        if (op == *cur)
+            return true;
+    }
+    return false;
+}
+
+long long Test::integer(const std::string& arg)
+{
+    const char* str = arg.c_str();
+    char* end;
+    errno = 0;
+    const long long val = strtoll(str, &end, 10);
+    while (isspace(static_cast<unsigned char>(*end)))
+        ++end;
+    if (end == str || *end || errno)
+        error(arg + ": integer expression expected");
+    return val;
+}
+
+bool Test::unary(const std::string& op, const std::string& arg)
+{
+    const char* file = arg.c_str();
+    struct stat st;
+    switch (op[1]) {
+    case 'n':
+        return !arg.empty();
+    case 'z':
+        return arg.empty();
+    case 't': {
+        const long long fd = integer(arg);
+        // the builtin's stdio are the process' 0, 1 and 2. it has no
+        // redirects, so the process wouldn't have any other fd open
+        if (fd >= 0 && fd <= 2)
+            return isatty(mCtx.fds[fd]) != 0;
+        return false; }
+    case 'h':
+    case 'L':
+        return lstat(file, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r':
+        return faccessat(AT_FDCWD, file, R_OK, AT_EACCESS) == 0;
+    case 'w':
+        return faccessat(AT_FDCWD, file, W_OK, AT_EACCESS) == 0;
+    case 'x':
+        return faccessat(AT_FDCWD, file, X_OK, AT_EACCESS) == 0;
+    }
+    if (::stat(file, &st) != 0)
+        return false;
+    switch (op[1]) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'e': return true;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'G': return st.st_gid == getegid();
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    }
+    return false;
+}
+
+bool Test::binary(const std::string& left, const std::string& op, const std::string& right)
+{
+    if (op == "=" || op == "==")
+        return left == right;
+    if (op == "!=")
+        return left != right;
+    if (op == "<")
+        return left < right;
+    if (op == ">")
+        return left > right;
+    if (op == "-nt" || op == "-ot" || op == "-ef") {
+        struct stat l, r;
+        const bool hasl = ::stat(left.c_str(), &l) == 0;
+        const bool hasr = ::stat(right.c_str(), &r) == 0;
+        if (op == "-ef")
+            return hasl && hasr && l.st_dev == r.st_dev && l.st_ino == r.st_ino;
+        // a file that doesn't exist is older than any that does
+        if (!hasl || !hasr)
+            return op == "-nt" ? hasl : hasr;
+        const bool newer = l.st_mtim.tv_sec > r.st_mtim.tv_sec
+            || (l.st_mtim.tv_sec == r.st_mtim.tv_sec && l.st_mtim.tv_nsec > r.st_mtim.tv_nsec);
+        const bool older = r.st_mtim.tv_sec > l.st_mtim.tv_sec
+            || (r.st_mtim.tv_sec == l.st_mtim.tv_sec && r.st_mtim.tv_nsec > l.st_mtim.tv_nsec);
+        return op == "-nt" ? newer : older;
+    }
+    const long long l = integer(left), r = integer(right);
+    if (op == "-eq") return l == r;
+    if (op == "-ne") return l != r;
+    if (op == "-lt") return l < r;
+    if (op == "-le") return l <= r;
+    if (op == "-gt") return l > r;
+    return l >= r;
+}
+
+// the posix rules for count arguments starting at mPos
+bool Test::args(size_t count)
+{
+    const size_t p = mPos;
+    switch (count) {
+    case 0:
+        return false;
+    case 1:
+        mPos += 1;
+        return !mArgs[p].empty();
+    case 2:
+        if (mArgs[p] == "!") {
+            mPos += 1;
+            return !args(1);
+        }
+        if (isUnary(mArgs[p])) {
+            mPos += 2;
+            return unary(mArgs[p], mArgs[p + 1]);
+        }
+        error(mArgs[p] + ": unary operator expected");
+        return false;
+    case 3:
+        if (isBinary(mArgs[p + 1])) {
+            mPos += 3;
+            return binary(mArgs[p], mArgs[p + 1], mArgs[p + 2]);
+        }
+        if (mArgs[p + 1] == "-a" || mArgs[p + 1] == "-o")
+            break;
+        if (mArgs[p] == "!") {
+            mPos += 1;
+            return !args(2);
+        }
+        if (mArgs[p] == "(" && mArgs[p + 2] == ")") {
+            mPos += 1;
+            const bool ret = args(1);
+            mPos += 1;
+            return ret;
+        }
+        error(mArgs[p + 1] + ": binary operator expected");
+        return false;
+    case 4:
+        if (mArgs[p] == "!") {
+            mPos += 1;
+            return !args(3);
+        }
+        if (mArgs[p] == "(" && mArgs[p + 3] == ")") {
+            mPos += 1;
+            const bool ret = args(2);
+            mPos += 1;
+            return ret;
+        }
+        break;
+    }
+    return orExpr();
+}
+
+bool Test::orExpr()
+{
+    bool ret = andExpr();
+    while (mPos < mEnd && mArgs[mPos] == "-o") {
+        ++mPos;
+        const bool r = andExpr();
+        ret = ret || r;
+    }
+    return ret;
+}
+
+bool Test::andExpr()
+{
+    bool ret = notExpr();
+    while (mPos < mEnd && mArgs[mPos] == "-a") {
+        ++mPos;
+        const bool r = notExpr();
+        ret = ret && r;
+    }
+    return ret;
+}
+
+bool Test::notExpr()
+{
+    if (mPos < mEnd && mArgs[mPos] == "!") {
+        ++mPos;
+        return !notExpr();
+    }
+    return primary();
+}
+
+bool Test::primary()
+{
+    if (mPos >= mEnd) {
+        error("argument expected");
+        return false;
+    }
+    const std::string& arg = mArgs[mPos];
+    if (arg == "(") {
+        ++mPos;
+        const bool ret = orExpr();
+        if (mPos >= mEnd || mArgs[mPos] != ")")
+            error("`)' expected");
+        ++mPos;
+        return ret;
+    }
+    if (mPos + 2 < mEnd && isBinary(mArgs[mPos + 1])) {
+        mPos += 3;
+        return binary(arg, mArgs[mPos - 2], mArgs[mPos - 1]);
+    }
+    if (isUnary(arg) && mPos + 1 < mEnd) {
+        mPos += 2;
+        return unary(arg, mArgs[mPos - 1]);
+    }
+    ++mPos;
+    return !arg.empty();
+}
+
+int Test::run()
+{
+    const bool ret = args(mEnd);
+    if (mError.empty() && mPos < mEnd)
+        error(mArgs[mPos] + ": too many arguments");
+    if (!mError.empty()) {
+        mCtx.err += mCtx.name + ": " + mError + "\n";
+        return 2;
+    }
+    return ret ? 0 : 1;
+}
+
+static int builtinTest(Builtin::Context& ctx)
+{
+    size_t end = ctx.args->size();
+    if (ctx.name == "[") {
+        if (!end || ctx.args->back() != "]") {
+            ctx.err += "[: missing `]'\n";
+            return 2;
+        }
+        --end;
+    }
+    Test test(ctx, end);
+    return test.run();
+}
+
+static const struct {
+    const char* name;
+    Builtin::Function function;
+} builtins[] = {
+    { ":", builtinTrue },
+    { "true", builtinTrue },
+    { "false", builtinFalse },
+    { "echo", builtinEcho },
+    { "printf", builtinPrintf },
+    { "test", builtinTest },
+    { "[", builtinTest },
+    { 0, 0 }
+};
+
+Builtin::Function Builtin::find(const Process& proc)
+{
+    if (!proc.redirs().empty())
+        return 0;
+    const std::string& path = proc.path();
+    for (auto cur = builtins; cur->name; ++cur) {
+        if (path == cur->name)
+            return cur->function;
+    }
+    return 0;
+}
+
+std::vector<std::string> Builtin::names()
+{
+    std::vector<std::string> ret;
+    for (auto cur = builtins; cur->name; ++cur)
+        ret.push_back(cur->name);
+    return ret;
+}
+
+// the pipe has to take all of it right now, we're on the reader thread
+// and every job on it would wait for whoever reads the other end. it's
+// one the job made, so it's ours to grow
+static bool fits(int fd, size_t bytes)
+{
+    int queued = 0;
+    if (ioctl(fd, FIONREAD, &queued) != 0)
+        return false;
+    const size_t need = queued + bytes;
+    const int size = fcntl(fd, F_GETPIPE_SZ);
+    if (size > 0 && need <= static_cast<size_t>(size))
+        return true;
+    // the pipe can grow up to /proc/sys/fs/pipe-max-size
+    const int grown = fcntl(fd, F_SETPIPE_SZ, static_cast<int>(need));
+    return grown > 0 && need <= static_cast<size_t>(grown);
+}
+
+// all of data or false, never blocks. the write goes through a non-blocking
+// description of the pipe of its own, the processes that share fd keep
+// theirs as it is
+static bool write(int fd, const std::string& data)
+{
+    if (data.empty())
+        return true;
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int nb;
+    EINTRWRAP(nb, open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC));
+    if (nb == -1)
+        return false;
+    ssize_t w;
+    EINTRWRAP(w, ::write(nb, data.c_str(), data.size()));
+    int e;
+    EINTRWRAP(e, ::close(nb));
+    return w == static_cast<ssize_t>(data.size());
+}
+
+bool Builtin::run(const Process& proc, const int fds[3], uint8_t owned, int& status)
+{
+    const Function function = find(proc);
+    if (!function)
+        return false;
+
+    Context ctx;
+    ctx.name = proc.path();
+    ctx.args = &proc.args();
+    memcpy(ctx.fds, fds, sizeof(ctx.fds));
+    const int ret = function(ctx);
+    if (ret == Unsupported)
+        return false;
+
+    if (!ctx.out.empty() && (!(owned & OwnStdout) || !fits(fds[1], ctx.out.size())))
+        return false;
+    if (!ctx.err.empty() && (!(owned & OwnStderr) || ctx.err.size() > PIPE_BUF || !fits(fds[2], ctx.err.size())))
+        return false;
+    // stderr may be shared with processes of the job that are running
+    // already, it's small enough to go in whole or not at all. stdout is
+    // ours alone and has the room, so it can't come up short after that
+    if (!write(fds[2], ctx.err))
+        return false;
+    write(fds[1], ctx.out);
+    status = W_EXITCODE(ret & 0xff, 0);
+    return true;
+}
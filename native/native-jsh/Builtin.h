@@ -0,0 +1,48 @@
+#ifndef BUILTIN_H
+#define BUILTIN_H
+
+#include "Process.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// commands that are so cheap to run that starting a process for them costs
+// many times more than the command itself. the reader thread runs these in
+// place of a process when a job is launched: they don't read stdin, they
+// don't change anything and their output is written to the process' stdout
+// and stderr in one go. they're only used when that output can go into
+// pipes the job made itself without blocking, anything else (a terminal,
+// a pipe of our own parent, a full pipe) and the real command is started
+// instead
+class Builtin
+{
+public:
+    struct Context
+    {
+        // the name it was invoked as, for messages
+        std::string name;
+        const Process::Args* args;
+        // stdin, stdout and stderr of the process it stands in for
+        int fds[3];
+        std::string out, err;
+    };
+    // returns the exit code, or Unsupported for anything it doesn't know
+    // how to do, the real command is started for those
+    enum { Unsupported = -1 };
+    typedef int (*Function)(Context& ctx);
+
+    // the builtin that would run proc, null if it has to be a process.
+    // a path with a slash or any redirects always make it a process
+    static Function find(const Process& proc);
+
+    // runs proc if it's a builtin, status is set like waitpid() would.
+    // owned says which of fds are pipes the job created, only those are
+    // written to. false means that it has to be started as a process
+    enum { OwnStdout = 0x2, OwnStderr = 0x4 };
+    static bool run(const Process& proc, const int fds[3], uint8_t owned, int& status);
+
+    // the names of all builtins
+    static std::vector<std::string> names();
+};
+
+#endif
@@ -0,0 +1,305 @@
+#include "CommandHash.h"
+#include "utils.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+namespace {
+
+struct Dir
+{
+    std::string path;
+    // inotify watch descriptor, -1 if we go by mtime instead
+    int wd;
+    bool watchable, scanned;
+    struct timespec mtime;
+    std::unordered_set<std::string> exes;
+};
+
+struct Table
+{
+    std::vector<std::string> entries;
+    // null for relative entries, those depend on the cwd
+    // and are looked at every time instead
+    std::vector<std::shared_ptr<Dir> > dirs;
+    bool cacheable;
+    uint64_t generation;
+    // cmd -> file, an empty file if there isn't one
+    std::unordered_map<std::string, std::string> hits;
+};
+
+}
+
+enum {
+    WatchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB
+              | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR,
+    // distinct PATH values we keep tables for
+    MaxTables = 16
+};
+
+struct {
+    Mutex mutex;
+    bool initialized;
+    int inotify;
+    // bumped whenever a directory is read, tables with
+    // an older generation have to drop their hits
+    uint64_t generation;
+    std::unordered_map<std::string, std::shared_ptr<Dir> > dirs;
+    std::unordered_map<int, std::shared_ptr<Dir> > watches;
+    std::unordered_map<std::string, Table> tables;
+} static state;
+
+static bool isExecutable(const struct stat& st)
+{
+    static const uid_t uid = geteuid();
+    static const gid_t gid = getegid();
+
+    if (!S_ISREG(st.st_mode))
+        return false;
+    if (!uid)
+        return (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+    if (st.st_uid == uid)
+        return (st.st_mode & S_IXUSR) != 0;
+    if (st.st_gid == gid)
+        return (st.st_mode & S_IXGRP) != 0;
+    return (st.st_mode & S_IXOTH) != 0;
+}
+
+static void scan(const std::string& path, std::unordered_set<std::string>& exes)
+{
+    int fd;
+    EINTRWRAP(fd, ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1)
+        return;
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        int e;
+        EINTRWRAP(e, ::close(fd));
+        return;
+    }
+    struct stat st;
+    while (dirent* ent = readdir(dir)) {
+        if (ent->d_type == DT_DIR)
+            continue;
+        // d_type doesn't tell us the mode and symlinks need following anyway
+        if (fstatat(fd, ent->d_name, &st, 0) == 0 && isExecutable(st))
+            exes.insert(ent->d_name);
+    }
+    closedir(dir);
+}
+
+static void scan(Dir& dir)
+{
+    dir.exes.clear();
+    scan(dir.path, dir.exes);
+    dir.scanned = true;
+    ++state.generation;
+}
+
+static void init()
+{
+    if (state.initialized)
+        return;
+    state.initialized = true;
+    state.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+// picks up whatever inotify has told us since last time
+static void drain()
+{
+    if (state.inotify == -1)
+        return;
+
+    alignas(inotify_event) char buf[4096];
+    for (;;) {
+        ssize_t r;
+        EINTRWRAP(r, ::read(state.inotify, buf, sizeof(buf)));
+        if (r <= 0)
+            break;
+        const char* cur = buf;
+        const char* end = buf + r;
+        while (cur < end) {
+            const inotify_event* ev = reinterpret_cast<const inotify_event*>(cur);
+            cur += sizeof(inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events were lost, we can't trust anything
+                for (auto& dir : state.dirs)
+                    dir.second->scanned = false;
+                continue;
+            }
+            auto it = state.watches.find(ev->wd);
+            if (it == state.watches.end())
+                continue;
+            it->second->scanned = false;
+            if (ev->mask & IN_IGNORED) {
+                // the directory is gone, check its mtime until it's back
+                it->second->wd = -1;
+                state.watches.erase(it);
+            }
+        }
+    }
+}
+
+static void update(const std::shared_ptr<Dir>& dir)
+{
+    if (dir->wd != -1) {
+        if (!dir->scanned)
+            scan(*dir);
+        return;
+    }
+
+    if (state.inotify != -1 && dir->watchable) {
+        const int wd = inotify_add_watch(state.inotify, dir->path.c_str(), WatchMask);
+        if (wd != -1) {
+            dir->wd = wd;
+            state.watches[wd] = dir;
+            scan(*dir);
+            return;
+        }
+        // a missing directory might show up later, anything
+        // else (out of watches for one) won't get better
+        if (errno != ENOENT && errno != ENOTDIR)
+            dir->watchable = false;
+    }
+
+    struct timespec mtime = { 0, 0 };
+    struct stat st;
+    if (::stat(dir->path.c_str(), &st) == 0)
+        mtime = st.st_mtim;
+    if (!dir->scanned || mtime.tv_sec != dir->mtime.tv_sec || mtime.tv_nsec != dir->mtime.tv_nsec) {
+        dir->mtime = mtime;
+        scan(*dir);
+    }
+}
+
+static Table& table(const std::string& path)
+{
+    auto it = state.tables.find(path);
+    if (it != state.tables.end())
+        return it->second;
+
+    if (state.tables.size() >= MaxTables)
+        state.tables.clear();
+
+    Table& table = state.tables[path];
+    table.cacheable = true;
+    table.generation = state.generation;
+    for (auto& entry : split(path, ':')) {
+        // an empty entry is the current directory
+        if (entry.empty())
+            entry = ".";
+        std::shared_ptr<Dir> dir;
+        if (entry[0] == '/') {
+            dir = state.dirs[entry];
+            if (!dir) {
+                dir = std::make_shared<Dir>();
+                dir->path = entry;
+                dir->wd = -1;
+                dir->watchable = true;
+                dir->scanned = false;
+                dir->mtime = { 0, 0 };
+                state.dirs[entry] = dir;
+            }
+        } else {
+            table.cacheable = false;
+        }
+        table.entries.push_back(std::move(entry));
+        table.dirs.push_back(std::move(dir));
+    }
+    return table;
+}
+
+// brings all of the table's directories up to date
+static void update(Table& table)
+{
+    init();
+    drain();
+    for (const auto& dir : table.dirs) {
+        if (dir)
+            update(dir);
+    }
+    if (table.generation != state.generation) {
+        table.hits.clear();
+        table.generation = state.generation;
+    }
+}
+
+std::string CommandHash::find(const std::string& path, const std::string& cmd)
+{
+    if (cmd.empty())
+        return std::string();
+    if (cmd.find('/') != std::string::npos)
+        return cmd;
+
+    MutexLocker locker(&state.mutex);
+    Table& t = table(path);
+    update(t);
+
+    if (t.cacheable) {
+        auto it = t.hits.find(cmd);
+        if (it != t.hits.end())
+            return it->second;
+    }
+
+    std::string file;
+    struct stat st;
+    for (size_t i = 0; i < t.dirs.size(); ++i) {
+        const auto& dir = t.dirs[i];
+        if (dir) {
+            if (dir->exes.count(cmd)) {
+                file = dir->path + '/' + cmd;
+                break;
+            }
+        } else {
+            const std::string cur = t.entries[i] + '/' + cmd;
+            if (::stat(cur.c_str(), &st) == 0 && isExecutable(st)) {
+                file = cur;
+                break;
+            }
+        }
+    }
+
+    if (t.cacheable)
+        t.hits[cmd] = file;
+    return file;
+}
+
+std::vector<std::string> CommandHash::commands(const std::string& path)
+{
+    std::unordered_set<std::string> all;
+    {
+        MutexLocker locker(&state.mutex);
+        Table& t = table(path);
+        update(t);
+
+        for (size_t i = 0; i < t.dirs.size(); ++i) {
+            if (t.dirs[i])
+                all.insert(t.dirs[i]->exes.begin(), t.dirs[i]->exes.end());
+            else
+                scan(t.entries[i], all);
+        }
+    }
+    return std::vector<std::string>(all.begin(), all.end());
+}
+
+void CommandHash::clear()
+{
+    MutexLocker locker(&state.mutex);
+    // inotify is only set up by the first lookup, before that it's 0
+    if (state.initialized && state.inotify != -1) {
+        int e;
+        EINTRWRAP(e, ::close(state.inotify));
+    }
+    state.initialized = false;
+    state.inotify = -1;
+    state.dirs.clear();
+    state.watches.clear();
+    state.tables.clear();
+    ++state.generation;
+}
@@ -0,0 +1,26 @@
+#ifndef COMMANDHASH_H
+#define COMMANDHASH_H
+
+#include <string>
+#include <vector>
+
+// remembers which executables live in which $PATH directory, like the
+// hash table in other shells. each directory is read once and then watched
+// with inotify (or checked by mtime if it can't be watched), lookups are
+// cached per PATH value until one of its directories changes.
+// safe to use from any thread
+class CommandHash
+{
+public:
+    // the file that running cmd with this PATH would exec, or an empty
+    // string if there is none. a cmd with a slash in it is returned as is
+    static std::string find(const std::string& path, const std::string& cmd);
+
+    // the names of all executables in PATH, each name only once
+    static std::vector<std::string> commands(const std::string& path);
+
+    // forget everything we know
+    static void clear();
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include "Environment.h"
+
+ssize_t Environment::Snapshot::indexOf(const std::string& key) const
+{
+    auto it = mIndex.find(key);
+    if (it == mIndex.end())
+        return -1;
+    return it->second;
+}
+
+const char* Environment::Snapshot::get(const std::string& key) const
+{
+    auto it = mIndex.find(key);
+    if (it == mIndex.end())
+        return 0;
+    return mStrings[it->second].c_str() + key.size() + 1;
+}
+
+void Environment::set(const std::string& key, const std::string& value)
+{
+    auto it = mVars.find(key);
+    if (it != mVars.end()) {
+        if (it->second == value)
+            return;
+        it->second = value;
+    } else {
+        mVars[key] = value;
+    }
+    ++mVersion;
+    mSnapshot.reset();
+}
+
+void Environment::unset(const std::string& key)
+{
+    if (!mVars.erase(key))
+        return;
+    ++mVersion;
+    mSnapshot.reset();
+}
+
+std::shared_ptr<const Environment::Snapshot> Environment::snapshot() const
+{
+    if (mSnapshot)
+        return mSnapshot;
+
+    auto snapshot = std::make_shared<Snapshot>();
+    snapshot->mVersion = mVersion;
+    snapshot->mStrings.reserve(mVars.size());
+    snapshot->mIndex.reserve(mVars.size());
+    for (const auto& var : mVars) {
+        snapshot->mIndex[var.first] = snapshot->mStrings.size();
+        snapshot->mStrings.push_back(var.first + "=" + var.second);
+    }
+    // the strings don't move anymore
+    snapshot->mEnvp.reserve(snapshot->mStrings.size() + 1);
+    for (auto& str : snapshot->mStrings)
+        snapshot->mEnvp.push_back(&str[0]);
+    snapshot->mEnvp.push_back(0);
+
+    mSnapshot = snapshot;
+    return mSnapshot;
+}
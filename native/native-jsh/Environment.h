@@ -0,0 +1,66 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+
+// the shell's environment variables. changes are cheap, the envp that
+// processes are started with is built on first use after a change and
+// then shared by every process until the next one. only to be changed
+// from the loop thread, snapshots can be used from anywhere
+class Environment
+{
+public:
+    class Snapshot
+    {
+    public:
+        // null terminated, ready for execve()
+        char* const* envp() const { return mEnvp.data(); }
+        size_t size() const { return mStrings.size(); }
+        uint64_t version() const { return mVersion; }
+
+        // the index of key in envp() or -1 if it's not there
+        ssize_t indexOf(const std::string& key) const;
+        // the value of key, null if it's not there
+        const char* get(const std::string& key) const;
+
+    private:
+        uint64_t mVersion;
+        std::vector<std::string> mStrings;
+        std::vector<char*> mEnvp;
+        std::unordered_map<std::string, size_t> mIndex;
+
+        friend class Environment;
+    };
+
+    typedef std::unordered_map<std::string, std::string> Map;
+
+    Environment()
+        : mVersion(0)
+    {
+    }
+    explicit Environment(Map&& vars)
+        : mVars(std::forward<Map>(vars)), mVersion(0)
+    {
+    }
+
+    void set(const std::string& key, const std::string& value);
+    void unset(const std::string& key);
+    const Map& vars() const { return mVars; }
+
+    // bumped on every change
+    uint64_t version() const { return mVersion; }
+
+    std::shared_ptr<const Snapshot> snapshot() const;
+
+private:
+    Map mVars;
+    uint64_t mVersion;
+    mutable std::shared_ptr<const Snapshot> mSnapshot;
+};
+
+#endif
@@ -1,15 +1,28 @@
 #include "Job.h"
 #include "utils.h"
+#include "Spawn.h"
+#include "Builtin.h"
+#include "Zygote.h"
 #include <uv.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <poll.h>
 #include <unordered_map>
 #include <map>
+#include <algorithm>
 
 std::unordered_set<std::shared_ptr<Job> > Job::sJobs;
+std::unordered_map<pid_t, Job::Child> Job::sPids;
+size_t Job::sUnwatched;
+std::atomic<uint32_t> Job::sNextId;
 
 // we're going to need a thread that reads the out/err of the final process in our jobs
 
@@ -17,54 +30,190 @@ class JobReader;
 class JobWaiter;
 
 struct {
-    std::shared_ptr<JobReader> reader;
+    std::vector<std::shared_ptr<JobReader> > readers;
     std::shared_ptr<JobWaiter> waiter;
-    Mutex stdinMutex;
+    // exits are seen through pidfds on the reader threads, the
+    // waiter only has stopped processes and unwatched ones left
+    bool pidfds;
 } static state;
 
+// process wide counters for Job::stats(), relaxed is all they need
+struct {
+    std::atomic<uint64_t> started, finished, failed, timedOut;
+    std::atomic<uint64_t> processes, builtins, reaped, sigchld;
+    std::atomic<uint64_t> reapLatencyTotal, reapLatencyMax;
+    std::atomic<uint64_t> bytesRead, bytesWritten, bytesSpliced;
+} static counters;
+
+static inline void bump(std::atomic<uint64_t>& counter, uint64_t n = 1)
+{
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+enum { IdPidfd = 3 };
+
+static int openPidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// waitid() with the rusage that only the system call gives us. returns
+// the pid or 0 if there was nothing, status is set like waitpid() would
+static pid_t waitChild(int idtype, int id, int options, int& status, struct rusage* usage)
+{
+    siginfo_t info;
+    info.si_pid = 0;
+    int r;
+    EINTRWRAP(r, syscall(SYS_waitid, idtype, id, &info, options, usage));
+    if (r == -1 || !info.si_pid)
+        return 0;
+    switch (info.si_code) {
+    case CLD_EXITED:
+        status = W_EXITCODE(info.si_status, 0);
+        break;
+    case CLD_KILLED:
+        status = info.si_status;
+        break;
+    case CLD_DUMPED:
+        status = info.si_status | WCOREFLAG;
+        break;
+    default:
+        status = W_STOPCODE(info.si_status);
+        break;
+    }
+    return info.si_pid;
+}
+
 class JobReader
 {
 public:
     JobReader()
-        : mStopped(false)
+        : mJobCount(0), mFdCount(0), mPidfdCount(0), mWakeups(0), mStopped(false)
     {
         ::pipe(mPipe);
 
         int r = fcntl(mPipe[0], F_GETFL);
-        fcntl(mPipe[0], F_SETFL, r | O_NONBLOCK | O_CLOEXEC);
+        fcntl(mPipe[0], F_SETFL, r | O_NONBLOCK);
+        fcntl(mPipe[0], F_SETFD, FD_CLOEXEC);
         r = fcntl(mPipe[1], F_GETFL);
-        fcntl(mPipe[1], F_SETFL, r | O_CLOEXEC);
+        fcntl(mPipe[1], F_SETFL, r | O_NONBLOCK);
+        fcntl(mPipe[1], F_SETFD, FD_CLOEXEC);
+
+        mEpoll = epoll_create1(EPOLL_CLOEXEC);
+
+        // the wakeup pipe is level triggered so that a pending wakeup
+        // is never lost, everything else is edge triggered
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = mPipe[0];
+        epoll_ctl(mEpoll, EPOLL_CTL_ADD, mPipe[0], &ev);
+
+        // fires when the oldest coalesced output is due
+        mTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        mTimerArmed = 0;
+        ev.data.fd = mTimer;
+        epoll_ctl(mEpoll, EPOLL_CTL_ADD, mTimer, &ev);
     }
     ~JobReader()
     {
         int e;
+        for (const auto& pidfd : mPidfds) {
+            EINTRWRAP(e, ::close(pidfd.first));
+        }
+        EINTRWRAP(e, ::close(mEpoll));
+        EINTRWRAP(e, ::close(mTimer));
         EINTRWRAP(e, ::close(mPipe[0]));
         EINTRWRAP(e, ::close(mPipe[1]));
     }
 
     void add(const std::shared_ptr<Job>& job)
     {
-        JobData data = { job->mStdin, job->mStdout, job->mStderr, true, 0, 0, Buffer::Data() };
+        auto data = std::make_shared<JobData>();
+        data->job = job;
+        data->stdin = job->mStdin;
+        data->stdout = job->mStdout;
+        data->stderr = job->mStderr;
+        data->stdinBlocked = false;
+        data->stdoutThrottled = data->stderrThrottled = false;
+        data->stdoutDeadline = data->stderrDeadline = 0;
 
-        int r;
-        // make read pipes non-blocking
-        if (data.stdin != -1) {
-            r = fcntl(data.stdin, F_GETFL);
-            fcntl(data.stdin, F_SETFL, r | O_NONBLOCK);
-        }
+        MutexLocker locker(&mMutex);
+        mReads[job] = data;
+
+        // each fd is registered exactly once, it stays in the
+        // epoll set until it's closed or the job goes bad
+        if (data->stdin != -1)
+            addFd(data->stdin, EPOLLOUT | EPOLLET, data, Stdin);
+        if (data->stdout != -1)
+            addFd(data->stdout, EPOLLIN | EPOLLET, data, Stdout);
+        if (data->stderr != -1)
+            addFd(data->stderr, EPOLLIN | EPOLLET, data, Stderr);
+
+        // flush anything written before the job started
+        if (data->stdin != -1)
+            mDirty.push_back(job);
+
+        // hook up splice pipes, whichever end of the pipe is started
+        // last does the linking
+        if (!job->mPipeTarget.expired())
+            link(data, find(job->mPipeTarget));
+        if (!job->mPipeSource.expired())
+            link(find(job->mPipeSource), data);
 
-        if (data.stdout != -1) {
-            r = fcntl(data.stdout, F_GETFL);
-            fcntl(data.stdout, F_SETFL, r | O_NONBLOCK);
+        wakeup();
+    }
+
+    // called when a job has more data for stdin or when stdin was closed
+    void stdinChanged(const std::shared_ptr<Job>& job)
+    {
+        {
+            MutexLocker locker(&mMutex);
+            mDirty.push_back(job);
         }
+        wakeup();
+    }
 
-        if (data.stderr != -1) {
-            r = fcntl(data.stderr, F_GETFL);
-            fcntl(data.stderr, F_SETFL, r | O_NONBLOCK);
+    // start the job's processes on this thread, the loop is told
+    // about the pids (or the failure) once they have all exec'ed
+    void launch(const std::shared_ptr<Job>& job)
+    {
+        {
+            MutexLocker locker(&mMutex);
+            mLaunches.push_back(job);
         }
+        wakeup();
+    }
 
+    // reap the job's process at index when it exits, the exit is seen
+    // here along with the job's output. false if there's no pidfd for it
+    bool watch(const std::shared_ptr<Job>& job, size_t index, pid_t pid)
+    {
+        const int fd = openPidfd(pid);
+        if (fd == -1)
+            return false;
         MutexLocker locker(&mMutex);
-        mReads[job] = std::move(data);
+        mPidfds[fd] = { job, index };
+        mPidfdCount.store(mPidfds.size(), std::memory_order_relaxed);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &ev);
+        return true;
+    }
+
+    // start reading a throttled job's output again
+    void resume(const std::shared_ptr<Job>& job)
+    {
+        {
+            MutexLocker locker(&mMutex);
+            mResumed.push_back(job);
+        }
         wakeup();
     }
 
@@ -85,8 +234,42 @@ public:
 
     void wakeup();
 
+    Job::Stats::Reader stats() const
+    {
+        Job::Stats::Reader stats;
+        stats.jobs = mJobCount.load(std::memory_order_relaxed);
+        stats.fds = mFdCount.load(std::memory_order_relaxed);
+        stats.pidfds = mPidfdCount.load(std::memory_order_relaxed);
+        stats.wakeups = mWakeups.load(std::memory_order_relaxed);
+        return stats;
+    }
+
 private:
+    enum FdType { Stdin, Stdout, Stderr };
+    struct JobData;
+
     void run();
+    void addFd(int fd, uint32_t events, const std::shared_ptr<JobData>& data, FdType type);
+    void removeFd(int fd);
+    void removeJob(const std::shared_ptr<JobData>& data);
+    void reap(int pidfd);
+    bool writeStdin(const std::shared_ptr<JobData>& data);
+    bool readOutput(const std::shared_ptr<JobData>& data, FdType type);
+    bool transfer(const std::shared_ptr<JobData>& src);
+    void post(const std::shared_ptr<Job>& job, FdType type, Buffer& buffer);
+    // Coalesce may hold output back, Flush posts it now except for a
+    // trailing partial record and Final posts everything
+    enum DeliverMode { Coalesce, Flush, Final };
+    void deliver(const std::shared_ptr<Job>& job, const std::shared_ptr<JobData>& data, FdType type, DeliverMode mode);
+    void flushExpired(uint64_t now, uint64_t& next);
+    void armTimer(uint64_t deadline);
+    static bool shouldThrottle(const std::shared_ptr<Job>& job, size_t pending);
+    bool throttle(const std::shared_ptr<Job>& job, const std::shared_ptr<JobData>& data, FdType type);
+    void unthrottle(const std::shared_ptr<JobData>& data);
+    void closeStdin(const std::shared_ptr<JobData>& data);
+    void closeOutput(const std::shared_ptr<Job>& job, const std::shared_ptr<JobData>& data, FdType type);
+    std::shared_ptr<JobData> find(const std::weak_ptr<Job>& job) const;
+    void link(const std::shared_ptr<JobData>& src, const std::shared_ptr<JobData>& dst);
 
     static void run(void* arg)
     {
@@ -94,23 +277,65 @@ private:
         r->run();
     }
 
+    // for Job::stats(), the sizes as of the last wakeup
+    std::atomic<size_t> mJobCount, mFdCount, mPidfdCount;
+    std::atomic<uint64_t> mWakeups;
+
     uv_thread_t mThread;
     Mutex mMutex;
     int mPipe[2];
+    int mEpoll;
+    int mTimer;
+    uint64_t mTimerArmed;
     bool mStopped;
 
     struct JobData
     {
+        std::weak_ptr<Job> job;
         int stdin, stdout, stderr;
 
-        bool needsWrite;
-        size_t pendingOff, pendingRem;
-        Buffer::Data pendingWrite;
+        // the last write to stdin hit a full pipe
+        bool stdinBlocked;
+
+        Buffer::Cursor stdoutCursor, stderrCursor;
+        bool stdoutThrottled, stderrThrottled;
+
+        // output read but not yet posted because the job coalesces,
+        // the deadline is in uv_hrtime() nanoseconds, 0 for none
+        Buffer stdoutPending, stderrPending;
+        uint64_t stdoutDeadline, stderrDeadline;
+
+        // splice links, pipeOut is the job whose stdin our stdout feeds
+        std::shared_ptr<JobData> pipeOut;
+        std::weak_ptr<JobData> pipeIn;
     };
 
-    std::map<std::weak_ptr<Job>, JobData, std::owner_less<std::weak_ptr<Job> > > mReads;
+    struct FdData
+    {
+        std::shared_ptr<JobData> data;
+        FdType type;
+    };
+
+    std::map<std::weak_ptr<Job>, std::shared_ptr<JobData>, std::owner_less<std::weak_ptr<Job> > > mReads;
+    std::unordered_map<int, FdData> mFds;
+    struct Watched
+    {
+        std::weak_ptr<Job> job;
+        size_t index;
+    };
+    std::unordered_map<int, Watched> mPidfds;
+    std::vector<std::weak_ptr<Job> > mDirty, mResumed;
+    std::vector<std::shared_ptr<Job> > mLaunches;
 };
 
+inline bool JobReader::shouldThrottle(const std::shared_ptr<Job>& job, size_t pending)
+{
+    // a capture has to see everything, nothing is delivered before EOF anyway
+    if (job->isCapturing())
+        return false;
+    return job->mPaused || job->mQueuedBytes + pending >= job->mHighWatermark;
+}
+
 void JobReader::wakeup()
 {
     int e;
@@ -118,234 +343,567 @@ void JobReader::wakeup()
     EINTRWRAP(e, ::write(mPipe[1], &c, 1));
 }
 
-void JobReader::run()
+void JobReader::addFd(int fd, uint32_t events, const std::shared_ptr<JobData>& data, FdType type)
 {
-    enum ReadStatus { Ok, Closed, Error };
-    auto handleRead = [](const std::shared_ptr<Job>& weak, int fd, Buffer& buffer) -> ReadStatus {
-        int e;
-        uint8_t buf[32768];
+    // make pipes non-blocking
+    const int r = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, r | O_NONBLOCK);
+
+    FdData fddata = { data, type };
+    mFds[fd] = std::move(fddata);
+
+    epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void JobReader::removeFd(int fd)
+{
+    epoll_ctl(mEpoll, EPOLL_CTL_DEL, fd, 0);
+    mFds.erase(fd);
+}
+
+std::shared_ptr<JobReader::JobData> JobReader::find(const std::weak_ptr<Job>& job) const
+{
+    auto it = mReads.find(job);
+    if (it == mReads.end())
+        return std::shared_ptr<JobData>();
+    return it->second;
+}
+
+void JobReader::link(const std::shared_ptr<JobData>& src, const std::shared_ptr<JobData>& dst)
+{
+    if (!src || !dst)
+        return;
+    src->pipeOut = dst;
+    dst->pipeIn = src;
+    // the source might have been sitting on data (or EOF) while it
+    // waited for us, there won't be another edge for that
+    if (!transfer(src))
+        removeJob(src);
+}
+
+void JobReader::removeJob(const std::shared_ptr<JobData>& data)
+{
+    if (data->stdin != -1)
+        closeStdin(data);
+    if (data->stdout != -1)
+        removeFd(data->stdout);
+    if (data->stderr != -1)
+        removeFd(data->stderr);
+    mReads.erase(data->job);
+}
+
+void JobReader::reap(int pidfd)
+{
+    // a readable pidfd is an exited process, if it's not there to
+    // reap it never will be and the pidfd would stay readable
+    int status, e;
+    struct rusage usage;
+    const pid_t pid = waitChild(IdPidfd, pidfd, WEXITED | WNOHANG, status, &usage);
+    const uint64_t seen = uv_hrtime();
+    auto it = mPidfds.find(pidfd);
+    const Watched watched = it->second;
+    mPidfds.erase(it);
+    epoll_ctl(mEpoll, EPOLL_CTL_DEL, pidfd, 0);
+    EINTRWRAP(e, ::close(pidfd));
+    // posted after whatever output we have already posted for it
+    std::shared_ptr<Job> job = watched.job.lock();
+    if (pid && job)
+        job->mReaped(job, watched.index, status, usage, seen);
+}
+
+void JobReader::closeStdin(const std::shared_ptr<JobData>& data)
+{
+    int e;
+    removeFd(data->stdin);
+    if (data->stdin != STDIN_FILENO) {
+        // printf("closed stdin %d\n", data->stdin);
+        EINTRWRAP(e, ::close(data->stdin));
+    }
+    data->stdin = -1;
+    data->stdinBlocked = false;
+}
+
+bool JobReader::writeStdin(const std::shared_ptr<JobData>& data)
+{
+    if (data->stdin == -1)
+        return true;
+    std::shared_ptr<Job> job = data->job.lock();
+    if (!job)
+        return false;
+
+    enum { MaxIov = 64 };
+    iovec iov[MaxIov];
+
+    // the chunks belong to whoever called Job::write(), they're only
+    // valid while we hold the stdin mutex
+    size_t done = 0;
+    bool drain = false, close = false;
+    {
+        MutexLocker locker(&job->mStdinMutex);
+        data->stdinBlocked = false;
         for (;;) {
-            EINTRWRAP(e, ::read(fd, buf, sizeof(buf)));
+            if (job->mStdinChunks.empty()) {
+                // nothing more to do
+                close = job->mStdinClosed;
+                break;
+            }
+            int iovcnt = 0;
+            size_t offset = job->mStdinOffset;
+            for (const auto& chunk : job->mStdinChunks) {
+                iov[iovcnt].iov_base = const_cast<uint8_t*>(chunk.data) + offset;
+                iov[iovcnt].iov_len = chunk.size - offset;
+                offset = 0;
+                if (++iovcnt == MaxIov)
+                    break;
+            }
+            ssize_t e;
+            EINTRWRAP(e, ::writev(data->stdin, iov, iovcnt));
             if (e == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    return Ok;
-                return Error;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // wait for the next EPOLLOUT edge
+                    data->stdinBlocked = true;
+                } else {
+                    // the reading end went away, drop whatever we have left
+                    // but keep reading stdout/stderr
+                    done += job->mStdinChunks.size();
+                    job->mStdinChunks.clear();
+                    job->mStdinOffset = job->mStdinQueued = 0;
+                    job->mStdinClosed = close = true;
+                }
+                break;
             }
-            if (e == 0) {
-                // file descriptor closed
-                return Closed;
+            size_t written = e;
+            bump(counters.bytesWritten, written);
+            job->mStdinBytes.fetch_add(written, std::memory_order_relaxed);
+            job->mStdinQueued -= written;
+            while (written > 0) {
+                const auto& front = job->mStdinChunks.front();
+                const size_t rem = front.size - job->mStdinOffset;
+                if (written < rem) {
+                    job->mStdinOffset += written;
+                    break;
+                }
+                written -= rem;
+                job->mStdinOffset = 0;
+                job->mStdinChunks.pop_front();
+                ++done;
             }
+        }
+        if (job->mStdinNeedDrain && job->mStdinChunks.empty()) {
+            job->mStdinNeedDrain = false;
+            drain = !job->mStdinClosed;
+        }
+    }
+    if (close)
+        closeStdin(data);
+    if (done || drain)
+        job->stdinWritten()(job, done, drain);
+    return true;
+}
+
+void JobReader::closeOutput(const std::shared_ptr<Job>& job, const std::shared_ptr<JobData>& data, FdType type)
+{
+    // whatever is still being coalesced goes out before the close
+    deliver(job, data, type, Final);
+    int& fd = (type == Stdout) ? data->stdout : data->stderr;
+    // printf("closed %d\n", fd);
+    removeFd(fd);
+    fd = -1;
+    ((type == Stdout) ? data->stdoutCursor : data->stderrCursor).slab.reset();
+    job->ioClosed()(job, (type == Stdout) ? Job::Stdout : Job::Stderr);
+}
+
+void JobReader::post(const std::shared_ptr<Job>& job, FdType type, Buffer& buffer)
+{
+    if (buffer.empty())
+        return;
+    // counted before it's posted since the loop thread may deliver it
+    // right away. with no listener nobody will, and it's dropped
+    const size_t size = buffer.size();
+    job->mQueuedBytes += size;
+    const bool posted = (type == Stdout)
+        ? job->stdout()(job, std::move(buffer))
+        : job->stderr()(job, std::move(buffer));
+    if (!posted)
+        job->mQueuedBytes -= size;
+    buffer.clear();
+}
 
-            buffer.add(buf, e);
+void JobReader::deliver(const std::shared_ptr<Job>& job, const std::shared_ptr<JobData>& data, FdType type, DeliverMode mode)
+{
+    Buffer& buffer = (type == Stdout) ? data->stdoutPending : data->stderrPending;
+    uint64_t& deadline = (type == Stdout) ? data->stdoutDeadline : data->stderrDeadline;
+    if (buffer.empty())
+        return;
+    if (job->isCapturing() && type == Stdout) {
+        // the whole thing goes out in one piece at the end
+        if (mode != Final)
+            return;
+        if (job->mCapture & Job::CaptureTrimNewlines)
+            buffer.trimEnd('\n');
+        post(job, type, buffer);
+        return;
+    }
+    const uint32_t usecs = job->mCoalesceUsecs;
+    const size_t bytes = job->mCoalesceBytes;
+    if (mode == Coalesce && usecs && (!bytes || buffer.size() < bytes)) {
+        // hold on to it, the timer posts it if nothing else comes along
+        if (!deadline)
+            deadline = uv_hrtime() + usecs * 1000ull;
+        return;
+    }
+    deadline = 0;
+    const int delim = job->mDelimiter;
+    if (delim == Job::NoDelimiter || mode == Final) {
+        post(job, type, buffer);
+        return;
+    }
+    // only complete records go out, the rest stays here
+    // until the delimiter or EOF shows up
+    const size_t last = buffer.lastIndexOf(static_cast<uint8_t>(delim));
+    if (last == Buffer::npos)
+        return;
+    if (last + 1 == buffer.size()) {
+        post(job, type, buffer);
+    } else {
+        Buffer records = buffer.split(last + 1);
+        post(job, type, records);
+    }
+}
+
+void JobReader::flushExpired(uint64_t now, uint64_t& next)
+{
+    next = 0;
+    for (const auto& read : mReads) {
+        const auto& data = read.second;
+        if (!data->stdoutDeadline && !data->stderrDeadline)
+            continue;
+        std::shared_ptr<Job> job = data->job.lock();
+        if (!job)
+            continue;
+        if (data->stdoutDeadline && data->stdoutDeadline <= now)
+            deliver(job, data, Stdout, Flush);
+        if (data->stderrDeadline && data->stderrDeadline <= now)
+            deliver(job, data, Stderr, Flush);
+        for (uint64_t deadline : { data->stdoutDeadline, data->stderrDeadline }) {
+            if (deadline && (!next || deadline < next))
+                next = deadline;
         }
-        return Error;
-    };
+    }
+}
+
+void JobReader::armTimer(uint64_t deadline)
+{
+    if (deadline == mTimerArmed)
+        return;
+    // a zeroed it_value disarms the timer
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline / 1000000000ull;
+    spec.it_value.tv_nsec = deadline % 1000000000ull;
+    timerfd_settime(mTimer, TFD_TIMER_ABSTIME, &spec, 0);
+    mTimerArmed = deadline;
+}
+
+bool JobReader::throttle(const std::shared_ptr<Job>& job, const std::shared_ptr<JobData>& data, FdType type)
+{
+    // ask the loop thread to tell us when the consumer has caught up,
+    // then check again in case it already did
+    job->mThrottled = true;
+    if (!shouldThrottle(job, 0))
+        return false;
+
+    bool& throttled = (type == Stdout) ? data->stdoutThrottled : data->stderrThrottled;
+    if (!throttled) {
+        // stop polling for input, we'll still hear about hangups
+        epoll_event ev;
+        ev.events = EPOLLET;
+        ev.data.fd = (type == Stdout) ? data->stdout : data->stderr;
+        epoll_ctl(mEpoll, EPOLL_CTL_MOD, ev.data.fd, &ev);
+        throttled = true;
+    }
+    return true;
+}
+
+void JobReader::unthrottle(const std::shared_ptr<JobData>& data)
+{
+    // re-arming an fd that's readable gives us an edge right away
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    if (data->stdoutThrottled && data->stdout != -1) {
+        ev.data.fd = data->stdout;
+        epoll_ctl(mEpoll, EPOLL_CTL_MOD, data->stdout, &ev);
+    }
+    if (data->stderrThrottled && data->stderr != -1) {
+        ev.data.fd = data->stderr;
+        epoll_ctl(mEpoll, EPOLL_CTL_MOD, data->stderr, &ev);
+    }
+    data->stdoutThrottled = data->stderrThrottled = false;
+}
+
+bool JobReader::transfer(const std::shared_ptr<JobData>& src)
+{
+    enum { ChunkSize = 65536 };
+
+    if (src->stdout == -1)
+        return true;
+    std::shared_ptr<Job> job = src->job.lock();
+    if (!job)
+        return false;
+    const auto& dst = src->pipeOut;
+    assert(dst);
+
+    ssize_t e;
+    if (dst->stdin == -1) {
+        // nobody's reading anymore, close our end so that the
+        // producer gets EPIPE/SIGPIPE like in a regular pipeline
+        closeOutput(job, src, Stdout);
+        src->pipeOut.reset();
+        return true;
+    }
+
+    Buffer& buffer = src->stdoutPending;
+    for (;;) {
+        // checked every time, a stdout listener may come along at any point
+        if (job->mPipeTee.load(std::memory_order_relaxed)) {
+            if (shouldThrottle(job, buffer.size())) {
+                // the listeners can't keep up, which holds up the target as well
+                deliver(job, src, Stdout, Flush);
+                if (throttle(job, src, Stdout))
+                    return true;
+            }
+            // duplicate into the target pipe, then consume the same
+            // amount from our pipe for the stdout listeners
+            e = tee(src->stdout, dst->stdin, ChunkSize, SPLICE_F_NONBLOCK);
+            if (e > 0) {
+                const ssize_t rd = buffer.readFrom(src->stdout, src->stdoutCursor, e);
+                assert(rd == e);
+                (void)rd;
+                bump(counters.bytesSpliced, e);
+                bump(counters.bytesRead, e);
+                job->mStdoutBytes.fetch_add(e, std::memory_order_relaxed);
+                continue;
+            }
+        } else {
+            e = splice(src->stdout, 0, dst->stdin, 0, ChunkSize, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+            if (e > 0) {
+                bump(counters.bytesSpliced, e);
+                job->mStdoutBytes.fetch_add(e, std::memory_order_relaxed);
+                continue;
+            }
+        }
+        if (e == -1 && errno == EINTR)
+            continue;
+        const int err = errno;
+        deliver(job, src, Stdout, (e == -1 && (err == EAGAIN || err == EWOULDBLOCK)) ? Coalesce : Flush);
+        errno = err;
+        if (e == 0) {
+            // producer is done, hand EOF on to the consumer
+            if (std::shared_ptr<Job> target = dst->job.lock()) {
+                MutexLocker locker(&target->mStdinMutex);
+                target->mStdinClosed = true;
+            }
+            closeStdin(dst);
+            closeOutput(job, src, Stdout);
+            src->pipeOut.reset();
+            return true;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // either our pipe is empty or theirs is full,
+            // the next edge on either will get us back here
+            return true;
+        }
+        if (errno == EPIPE) {
+            closeStdin(dst);
+            closeOutput(job, src, Stdout);
+            src->pipeOut.reset();
+            return true;
+        }
+        return false;
+    }
+}
+
+bool JobReader::readOutput(const std::shared_ptr<JobData>& data, FdType type)
+{
+    std::shared_ptr<Job> job = data->job.lock();
+    if (!job)
+        return false;
+
+    int& fd = (type == Stdout) ? data->stdout : data->stderr;
+    auto& cursor = (type == Stdout) ? data->stdoutCursor : data->stderrCursor;
 
-    fd_set rdset, actualwrset;
-    fd_set* wrset = 0;
+    // edge triggered, read until the pipe is drained or
+    // until the consumer has as much as it can take
+    Buffer& buffer = (type == Stdout) ? data->stdoutPending : data->stderrPending;
+    ssize_t e;
     for (;;) {
-        // select on everything
-        wrset = 0;
-        FD_ZERO(&rdset);
-        FD_SET(mPipe[0], &rdset);
-        int max = mPipe[0];
-        // add the rest
+        if (shouldThrottle(job, buffer.size())) {
+            deliver(job, data, type, Flush);
+            if (throttle(job, data, type))
+                return true;
+        }
+        e = buffer.readFrom(fd, cursor);
+        if (e > 0) {
+            bump(counters.bytesRead, e);
+            ((type == Stdout) ? job->mStdoutBytes : job->mStderrBytes).fetch_add(e, std::memory_order_relaxed);
+        }
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                deliver(job, data, type, Coalesce);
+                return true;
+            }
+            return false;
+        }
+        if (e == 0) {
+            // file descriptor closed
+            closeOutput(job, data, type);
+            return true;
+        }
+    }
+}
+
+void JobReader::run()
+{
+    enum { MaxEvents = 64 };
+    epoll_event events[MaxEvents];
+
+    for (;;) {
+        int count;
+        EINTRWRAP(count, epoll_wait(mEpoll, events, MaxEvents, -1));
+        mWakeups.fetch_add(1, std::memory_order_relaxed);
+
+        // drain the wakeup pipe before looking at what we were woken up
+        // for, anything queued after this wakes us up again
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == mPipe[0]) {
+                char c[64];
+                int e;
+                for (;;) {
+                    EINTRWRAP(e, ::read(mPipe[0], c, sizeof(c)));
+                    if (e <= 0)
+                        break;
+                }
+                break;
+            }
+        }
+
+        std::vector<std::shared_ptr<Job> > launches;
         {
             MutexLocker locker(&mMutex);
             if (mStopped)
                 break;
+            std::swap(launches, mLaunches);
+        }
+        // each spawn waits for its child to exec, the loop thread must
+        // be able to hand us more work meanwhile so don't hold the lock
+        for (const auto& job : launches)
+            job->launch();
 
-            std::vector<std::weak_ptr<Job> > bad;
-            for (auto& r : mReads) {
-                auto& jobdata = r.second;
-                if (jobdata.stderr != -1) {
-                    FD_SET(jobdata.stderr, &rdset);
-                    if (jobdata.stderr > max)
-                        max = jobdata.stderr;
-                }
-                if (jobdata.stdout != -1) {
-                    // printf("adding out %d\n", jobdata.stdout);
-                    FD_SET(jobdata.stdout, &rdset);
-                    if (jobdata.stdout > max)
-                        max = jobdata.stdout;
+        MutexLocker locker(&mMutex);
+        if (mStopped)
+            break;
+
+        for (int i = 0; i < count; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd == mPipe[0])
+                continue;
+            if (fd == mTimer) {
+                uint64_t expirations;
+                int e;
+                EINTRWRAP(e, ::read(mTimer, &expirations, sizeof(expirations)));
+                mTimerArmed = 0;
+                continue;
+            }
+
+            if (mPidfds.count(fd)) {
+                reap(fd);
+                continue;
+            }
+
+            // the fd might have been removed by an earlier event in this batch
+            auto it = mFds.find(fd);
+            if (it == mFds.end())
+                continue;
+            const auto data = it->second.data;
+            bool ok = true;
+            switch (it->second.type) {
+            case Stdin:
+                if (std::shared_ptr<JobData> src = data->pipeIn.lock()) {
+                    if (!transfer(src))
+                        removeJob(src);
+                } else {
+                    ok = writeStdin(data);
                 }
-                if (jobdata.stdin != -1) {
-                    if (jobdata.needsWrite) {
-                        if (std::shared_ptr<Job> job = r.first.lock()) {
-                            jobdata.needsWrite = false;
-                            Buffer::Data data;
-                            size_t dataOff = 0, dataRem = 0;
-                            if (!jobdata.pendingWrite.empty()) {
-                                data = std::move(jobdata.pendingWrite);
-                                dataOff = jobdata.pendingOff;
-                                dataRem = jobdata.pendingRem;
-                                jobdata.pendingOff = 0;
-                                jobdata.pendingRem = 0;
-                            } else {
-                                data.resize(32768);
-                            }
-                            int e;
-                            for (;;) {
-                                if (!dataRem) {
-                                    dataOff = 0;
-                                    MutexLocker locker(&state.stdinMutex);
-                                    dataRem = job->mStdinBuffer.read(&data[0], data.size());
-                                    if (!dataRem) {
-                                        // nothing more to do
-                                        if (job->mStdinClosed) {
-                                            if (jobdata.stdin != STDIN_FILENO) {
-                                                // printf("closed stdin %d\n", jobdata.stdin);
-                                                EINTRWRAP(e, ::close(jobdata.stdin));
-                                            }
-                                            jobdata.stdin = -1;
-                                            jobdata.needsWrite = false;
-                                        }
-                                        break;
-                                    }
-                                }
-                                // printf("writing %zu bytes to stdin %d\n", dataRem, jobdata.stdin);
-                                // printf("native writing %s\n", std::string(reinterpret_cast<char*>(&data[0]) + dataOff, dataRem).c_str());
-                                EINTRWRAP(e, ::write(jobdata.stdin, &data[0] + dataOff, dataRem));
-                                // printf("wrote %d bytes to stdin %d\n", e, jobdata.stdin);
-                                if (e == -1) {
-                                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                                        jobdata.pendingWrite = std::move(data);
-                                        jobdata.pendingRem = dataRem;
-                                        jobdata.pendingOff = dataOff;
-                                    } else {
-                                        // bad job
-                                        bad.push_back(r.first);
-                                    }
-                                    break;
-                                }
-                                dataRem -= e;
-                                dataOff += e;
-                            }
-                        } else {
-                            // bad job
-                            bad.push_back(r.first);
-                            continue;
-                        }
-                    }
+                break;
+            case Stdout:
+                if (data->pipeOut) {
+                    ok = transfer(data);
+                    break;
                 }
-                if (!jobdata.pendingWrite.empty()) {
-                    // printf("still have pendingwrite\n");
-                    assert(jobdata.stdin != -1);
-                    wrset = &actualwrset;
-                    FD_ZERO(&actualwrset);
-                    FD_SET(jobdata.stdin, &actualwrset);
-                    if (jobdata.stdin > max)
-                        max = jobdata.stdin;
-                } else {
-                    // printf("no pendingwrite\n");
-                    // we might have more data on stdin
-                    int e;
-                    if (std::shared_ptr<Job> job = r.first.lock()) {
-                        MutexLocker locker(&state.stdinMutex);
-                        if (!job->mStdinBuffer.empty()) {
-                            // printf("but buffer is not empty\n");
-                            jobdata.needsWrite = true;
-                        } else if (job->mStdinClosed) {
-                            // printf("wanting to close\n");
-                            if (jobdata.stdin != STDIN_FILENO) {
-                                // printf("closed stdin %d\n", jobdata.stdin);
-                                EINTRWRAP(e, ::close(jobdata.stdin));
-                            }
-                            jobdata.stdin = -1;
-                        }
-                    } else {
-                        bad.push_back(r.first);
+                if (std::shared_ptr<Job> job = data->job.lock()) {
+                    if (!job->mPipeTarget.expired()) {
+                        // the other end isn't started yet, leave the data
+                        // in the kernel until it is
+                        break;
                     }
                 }
+                ok = readOutput(data, Stdout);
+                break;
+            case Stderr:
+                ok = readOutput(data, Stderr);
+                break;
             }
-            for (const auto j : bad) {
-                mReads.erase(j);
+            if (!ok) {
+                // bad job, take it out
+                removeJob(data);
             }
         }
-        // printf("selecting %d\n", max);
-        int r = ::select(max + 1, &rdset, wrset, 0, 0);
-        // printf("selected %d\n", r);
-        if (r > 0) {
-            if (FD_ISSET(mPipe[0], &rdset)) {
-                // drain pipe
-                char c;
-                int e;
-                for (;;) {
-                    EINTRWRAP(e, ::read(mPipe[0], &c, 1));
-                    if (e != 1)
-                        break;
-                }
 
+        // jobs with new stdin data
+        std::vector<std::weak_ptr<Job> > dirty;
+        std::swap(dirty, mDirty);
+        for (const auto& job : dirty) {
+            auto it = mReads.find(job);
+            if (it == mReads.end())
+                continue;
+            const auto data = it->second;
+            if (data->stdinBlocked) {
+                // still waiting for the pipe to become writable
+                continue;
             }
-            {
-                Buffer buffer;
-
-                MutexLocker locker(&mMutex);
-                std::vector<std::weak_ptr<Job> > bad;
-                for (auto& r : mReads) {
-                    auto& jobdata = r.second;
-                    bool handled = true;
-                    bool outclosed = false;
-                    if (jobdata.stdout != -1 && FD_ISSET(jobdata.stdout, &rdset)) {
-                        // printf("handling out\n");
-                        handled = false;
-                        if (std::shared_ptr<Job> job = r.first.lock()) {
-                            auto state = handleRead(job, jobdata.stdout, buffer);
-                            switch (state) {
-                            case Ok:
-                                handled = true;
-                                job->stdout()(job, std::move(buffer));
-                                buffer.clear();
-                                break;
-                            case Closed:
-                                // printf("out closed\n");
-                                handled = true;
-                                outclosed = true;
-                                jobdata.stdout = -1;
-                                if (!buffer.empty())
-                                    job->stdout()(job, std::move(buffer));
-                                job->ioClosed()(job, Job::Stdout);
-                                break;
-                            case Error:
-                                break;
-                            }
-                        }
-                    }
-                    if (jobdata.stderr != -1 && FD_ISSET(jobdata.stderr, &rdset)) {
-                        handled = false;
-                        if (std::shared_ptr<Job> job = r.first.lock()) {
-                            auto state = handleRead(job, jobdata.stderr, buffer);
-                            switch (state) {
-                            case Ok:
-                                handled = true;
-                                job->stderr()(job, std::move(buffer));
-                                buffer.clear();
-                            case Closed:
-                                // printf("err closed\n");
-                                if (!outclosed)
-                                    handled = true;
-                                jobdata.stderr = -1;
-                                if (!buffer.empty())
-                                    job->stderr()(job, std::move(buffer));
-                                job->ioClosed()(job, Job::Stderr);
-                                break;
-                            case Error:
-                                break;
-                            }
-                        }
-                    }
-                    if (!handled) {
-                        // bad job, take it out
-                        bad.push_back(r.first);
-                    } else if (wrset && FD_ISSET(jobdata.stdin, wrset)) {
-                        jobdata.needsWrite = true;
-                    }
-                }
-                for (const auto j : bad) {
-                    mReads.erase(j);
-                }
-            }
+            if (!writeStdin(data))
+                removeJob(data);
+        }
+
+        // jobs whose consumers caught up
+        std::vector<std::weak_ptr<Job> > resumed;
+        std::swap(resumed, mResumed);
+        for (const auto& job : resumed) {
+            auto it = mReads.find(job);
+            if (it != mReads.end())
+                unthrottle(it->second);
         }
+
+        // post coalesced output that has waited long enough and
+        // wake up again for whatever is due next
+        uint64_t next;
+        flushExpired(uv_hrtime(), next);
+        armTimer(next);
+
+        // forget jobs that have nothing left for us to do
+        for (auto it = mReads.begin(); it != mReads.end();) {
+            const auto& data = it->second;
+            if (data->stdin == -1 && data->stdout == -1 && data->stderr == -1)
+                it = mReads.erase(it);
+            else
+                ++it;
+        }
+        mJobCount.store(mReads.size(), std::memory_order_relaxed);
+        mFdCount.store(mFds.size(), std::memory_order_relaxed);
+        mPidfdCount.store(mPidfds.size(), std::memory_order_relaxed);
     }
 }
 
@@ -360,6 +918,9 @@ public:
     void start();
     void stop();
 
+    // check on all jobs, as if we had gotten a SIGCHLD
+    static void wake() { uv_async_send(&sAsync); }
+
 private:
     uv_signal_t mHandler;
 
@@ -372,35 +933,58 @@ void JobWaiter::start()
 {
     uv_async_init(uv_default_loop(), &sAsync, [](uv_async_t*) {
             // printf("SIGCHLD\n");
-            int status;
-            pid_t w;
-            std::vector<std::shared_ptr<Job> > dead;
-            for (auto job : Job::sJobs) {
-                for (auto& proc : job->mProcs) {
-                    EINTRWRAP(w, waitpid(proc.pid(), &status, WNOHANG | WUNTRACED));
-                    if (w > 0) {
-                        job->updateState(proc, status);
-                        if (job->isTerminated()) {
-                            job->setStatus(status);
-                            // if our job is completely done we should notify someone(tm)
-                            if (job->isIoClosed()) {
-                                job->stateChanged()(job, Job::Terminated, status);
-                                // and die
-                                dead.push_back(job);
-                            }
-                        } else if (job->isStopped()) {
-                            // save terminal modes in job if it's in the foreground
-                            if (job->mMode == Job::Foreground) {
-                                tcgetattr(STDIN_FILENO, &job->mTmodes);
-                            }
-                            job->stateChanged()(job, Job::Stopped, 0);
-                        }
-                    }
+            bump(counters.sigchld);
+            // exits of watched processes are the reader's, only ever
+            // ask for what we may take
+            const int watchedEvents = WSTOPPED;
+            const int allEvents = WEXITED | WSTOPPED;
+            auto reap = [](pid_t pid, int events) {
+                int status;
+                struct rusage usage;
+                if (!waitChild(P_PID, pid, events | WNOHANG, status, &usage))
+                    return false;
+                const Job::Child child = Job::sPids[pid];
+                child.job->reaped(child.index, status, usage, uv_hrtime());
+                return true;
+            };
+            auto events = [&](pid_t pid) {
+                const auto& child = Job::sPids[pid];
+                return child.watched ? watchedEvents : allEvents;
+            };
+
+            // see which child is waiting without reaping it, we only reap
+            // our own. node has children of its own, and a child that
+            // exits before its job knows the pid is reaped once it does
+            bool foreign = false;
+            for (;;) {
+                siginfo_t info;
+                info.si_pid = 0;
+                int r;
+                EINTRWRAP(r, waitid(P_ALL, 0, &info, (state.pidfds ? watchedEvents : allEvents) | WNOHANG | WNOWAIT));
+                if (r == -1 || !info.si_pid)
+                    break;
+                if (Job::sPids.count(info.si_pid)) {
+                    if (!reap(info.si_pid, events(info.si_pid)))
+                        break;
+                    continue;
                 }
+                if (info.si_code != CLD_STOPPED && Zygote::exited(info.si_pid))
+                    continue;
+                foreign = true;
+                break;
             }
-            for (auto job : dead) {
-                // printf("erasing from jobs(1)\n");
-                Job::sJobs.erase(job);
+            if (foreign || (state.pidfds && Job::sUnwatched)) {
+                // either something is in the way of everything that waits
+                // behind it, until whoever owns it reaps it, or there are
+                // exits that no pidfd tells us about. ask each child of ours
+                std::vector<pid_t> pids;
+                pids.reserve(Job::sPids.size());
+                for (const auto& pid : Job::sPids) {
+                    if (foreign || !pid.second.watched)
+                        pids.push_back(pid.first);
+                }
+                for (pid_t pid : pids)
+                    reap(pid, events(pid));
             }
         });
 
@@ -415,19 +999,103 @@ void JobWaiter::stop()
     uv_signal_stop(&mHandler);
 }
 
-void Job::updateState(Process& proc, int status)
+void Job::reaped(size_t index, int status, const struct rusage& usage, uint64_t seen)
+{
+    auto job = shared_from_this();
+    if (!WIFSTOPPED(status)) {
+        bump(counters.reaped);
+        const uint64_t latency = (uv_hrtime() - seen) / 1000;
+        bump(counters.reapLatencyTotal, latency);
+        uint64_t max = counters.reapLatencyMax.load(std::memory_order_relaxed);
+        while (latency > max && !counters.reapLatencyMax.compare_exchange_weak(max, latency, std::memory_order_relaxed)) { }
+    }
+    auto& proc = mProcs[index];
+    if (!WIFSTOPPED(status)) {
+        auto it = sPids.find(proc.pid());
+        if (it != sPids.end()) {
+            if (!it->second.watched)
+                --sUnwatched;
+            sPids.erase(it);
+        }
+    }
+    updateState(proc, status, &usage);
+    if (isTerminated()) {
+        setStatus(status);
+        // if our job is completely done we should notify someone(tm)
+        if (isIoClosed()) {
+            // a failed job has already said so
+            if (!mFailed) {
+                bump(counters.finished);
+                mStateChanged(job, Terminated, status);
+            }
+            // and die
+            // printf("erasing from jobs(1)\n");
+            sJobs.erase(job);
+        }
+    } else if (isStopped()) {
+        // save terminal modes in job if it's in the foreground
+        if (mMode == Foreground) {
+            tcgetattr(STDIN_FILENO, &mTmodes);
+        }
+        mStateChanged(job, Stopped, 0);
+    }
+}
+
+void Job::updateState(Process& proc, int status, const struct rusage* usage)
 {
     proc.mStatus = status;
     if (WIFSTOPPED(status)) {
         proc.mState = Process::Stopped;
     } else {
         proc.mState = Process::Terminated;
+        if (usage) {
+            Process::Usage& u = proc.mUsage;
+            u.user = usage->ru_utime.tv_sec * 1000000ull + usage->ru_utime.tv_usec;
+            u.system = usage->ru_stime.tv_sec * 1000000ull + usage->ru_stime.tv_usec;
+            u.maxRss = usage->ru_maxrss;
+            u.minorFaults = usage->ru_minflt;
+            u.majorFaults = usage->ru_majflt;
+            u.voluntarySwitches = usage->ru_nvcsw;
+            u.involuntarySwitches = usage->ru_nivcsw;
+        }
+        if (!mEndTime && isTerminated()) {
+            mEndTime = uv_hrtime();
+            cancelTimeout();
+        }
     }
     proc.stateChanged()(&proc, proc.mState);
 }
 
+Process::Usage Job::usage() const
+{
+    Process::Usage usage = Process::Usage();
+    for (const auto& proc : mProcs) {
+        const Process::Usage& u = proc.usage();
+        usage.user += u.user;
+        usage.system += u.system;
+        usage.maxRss = std::max(usage.maxRss, u.maxRss);
+        usage.minorFaults += u.minorFaults;
+        usage.majorFaults += u.majorFaults;
+        usage.voluntarySwitches += u.voluntarySwitches;
+        usage.involuntarySwitches += u.involuntarySwitches;
+    }
+    return usage;
+}
+
+uint64_t Job::elapsed() const
+{
+    if (!mStartTime)
+        return 0;
+    return ((mEndTime ? mEndTime : uv_hrtime()) - mStartTime) / 1000;
+}
+
 void Job::setMode(Mode m, bool resume)
 {
+    if (mStarting) {
+        // there's no process group yet, launched() applies the mode
+        mMode = m;
+        return;
+    }
     switch (m) {
     case Foreground: {
         tcsetpgrp(STDIN_FILENO, mPgid);
@@ -445,133 +1113,6 @@ void Job::setMode(Mode m, bool resume)
     mMode = m;
 }
 
-void Job::launch(Process* proc, int in, int out, int err, int notif, Mode m, bool is_interactive)
-{
-    if (is_interactive) {
-        pid_t pid = getpid();
-        if (mPgid == 0) mPgid = pid;
-        setpgid(pid, mPgid);
-        if (m == Foreground) {
-            tcsetpgrp(STDIN_FILENO, mPgid);
-        }
-    }
-
-    int e;
-    signal(SIGINT, SIG_DFL);
-    signal(SIGQUIT, SIG_DFL);
-    signal(SIGTSTP, SIG_DFL);
-    signal(SIGTTIN, SIG_DFL);
-    signal(SIGTTOU, SIG_DFL);
-    signal(SIGCHLD, SIG_DFL);
-
-    if (in != STDIN_FILENO) {
-        EINTRWRAP(e, dup2(in, STDIN_FILENO));
-        EINTRWRAP(e, ::close(in));
-    }
-    if (out != STDOUT_FILENO) {
-        EINTRWRAP(e, dup2(out, STDOUT_FILENO));
-        EINTRWRAP(e, ::close(out));
-    }
-    if (err != STDERR_FILENO) {
-        EINTRWRAP(e, dup2(err, STDERR_FILENO));
-        EINTRWRAP(e, ::close(err));
-    }
-
-    // apply redirections
-    const auto& redirs = proc->redirs();
-    for (const auto redir : redirs) {
-        // if this is a redirect to a file, open it
-        int tofd;
-        if (!redir.file.empty()) {
-            const int oflag = O_WRONLY | O_CREAT | (redir.append ? O_APPEND : O_TRUNC);
-            tofd = open(redir.file.c_str(), oflag, 0666);
-            if (tofd == -1) {
-                // bad, notify parent
-                char c = 1;
-                EINTRWRAP(e, ::write(notif, &c, 1));
-                EINTRWRAP(e, ::close(notif));
-
-                exit(-1);
-            }
-        } else {
-            assert(redir.tofd != -1);
-            tofd = redir.tofd;
-        }
-        // dup
-        EINTRWRAP(e, dup2(tofd, redir.fromfd));
-        EINTRWRAP(e, ::close(tofd));
-    }
-
-    // build argv and envp
-    const auto& args = proc->args();
-    const auto& environ = proc->environ();
-
-    const auto paths = split(get<std::string>(environ, "PATH"), ':');
-    auto pathify = [&paths](const std::string& cmd) {
-        if (cmd.empty())
-            return cmd;
-        if (cmd[0] == '/')
-            return cmd;
-
-        int r;
-        struct stat st;
-        for (auto p : paths) {
-            auto cur = p + '/' + cmd;
-            r = stat(cur.c_str(), &st);
-            if (r == 0) {
-                if ((st.st_mode & (S_IFREG|S_IXUSR)) == (S_IFREG|S_IXUSR)) {
-                    // success
-                    return cur;
-                }
-            }
-        }
-        return cmd;
-    };
-
-    const char** argv = reinterpret_cast<const char**>(malloc((args.size() + 2) * sizeof(char*)));
-    argv[0] = strdup(proc->path().c_str());
-    argv[args.size() + 1] = 0;
-    int idx = 0;
-    for (const std::string& arg : args) {
-        argv[++idx] = strdup(arg.c_str());
-    }
-    char** envp = reinterpret_cast<char**>(malloc((environ.size() + 1) * sizeof(char*)));
-    envp[environ.size()] = 0;
-    idx = 0;
-    for (const auto& env : environ) {
-        envp[idx++] = strdup((env.first + "=" + env.second).c_str());
-    }
-
-    // we need to find proc->path() in $PATH
-    const auto resolved = pathify(proc->path());
-
-    // FILE* f = fopen("/tmp/jshproc.txt", "a");
-    // fprintf(f, "going to run '%s'\n", resolved.c_str());
-    // fclose(f);
-
-    if (in == STDIN_FILENO) {
-        // I really have NO idea why I have to do this but it seems to fix issues
-
-        int dupped;
-        EINTRWRAP(dupped, dup(STDIN_FILENO));
-        EINTRWRAP(e, dup2(dupped, STDIN_FILENO));
-        EINTRWRAP(e, ::close(dupped));
-    }
-
-    execve(resolved.c_str(), const_cast<char*const*>(argv), envp);
-
-    // notify parent
-    char c = 1;
-    EINTRWRAP(e, ::write(notif, &c, 1));
-    EINTRWRAP(e, ::close(notif));
-
-    exit(-1);
-
-    // FILE* f2 = fopen("/tmp/jshproc.txt", "a");
-    // fprintf(f2, "but failed miserably %d\n", errno);
-    // fclose(f2);
-}
-
 void Job::start(Mode m, uint8_t fdmode)
 {
     {
@@ -597,22 +1138,48 @@ void Job::start(Mode m, uint8_t fdmode)
                         job->mStdin = -1;
                     }
                     if (job->isTerminated()) {
-                        job->stateChanged()(job, Job::Terminated, job->status());
+                        // a failed job has already said so
+                        if (!job->mFailed) {
+                            bump(counters.finished);
+                            job->stateChanged()(job, Job::Terminated, job->status());
+                        }
                         // printf("erasing from jobs(2)\n");
                         sJobs.erase(job);
                     }
                 }
             });
+        mLaunched.on([](const std::shared_ptr<Job>& job, const std::vector<Started>& started, int error, const std::string& failure) {
+                job->launched(started, error, failure);
+            });
+        mReaped.on([](const std::shared_ptr<Job>& job, size_t index, int status, const struct rusage& usage, uint64_t seen) {
+                job->reaped(index, status, usage, seen);
+            });
     }
 
     sJobs.insert(shared_from_this());
+    bump(counters.started);
+    mStartTime = uv_hrtime();
+    if (mTimeout)
+        armTimeout(mTimeout);
 
     static bool is_interactive = isatty(STDIN_FILENO) != 0;
 
-    int p[2] = { -1, -1 }, in = -1, out, lastout, err = -1;
+    mCapture = fdmode & (CaptureStdout | CaptureTrimNewlines);
+    if (mCapture & CaptureStdout)
+        fdmode |= DupStdout;
+
+    // spliced jobs always need the pipes on both ends
+    if (!mPipeTarget.expired())
+        fdmode |= DupStdout;
+    if (!mPipeSource.expired())
+        fdmode |= DupStdin;
+
+    // every pipe is close-on-exec, the ends a child needs are dup2'ed
+    // onto 0, 1 and 2 which clears the flag for those
+    int p[2] = { -1, -1 }, in = -1, lastout, err = -1;
 
     if (fdmode & DupStdin) {
-        ::pipe(p);
+        ::pipe2(p, O_CLOEXEC);
         mStdin = p[1];
         in = p[0];
     } else {
@@ -621,7 +1188,7 @@ void Job::start(Mode m, uint8_t fdmode)
     }
 
     if (fdmode & DupStderr) {
-        ::pipe(p);
+        ::pipe2(p, O_CLOEXEC);
         mStderr = p[0];
         err = p[1];
     } else {
@@ -630,7 +1197,7 @@ void Job::start(Mode m, uint8_t fdmode)
     }
 
     if (fdmode & DupStdout) {
-        ::pipe(p);
+        ::pipe2(p, O_CLOEXEC);
         mStdout = p[0];
         lastout = p[1];
     } else {
@@ -638,103 +1205,79 @@ void Job::start(Mode m, uint8_t fdmode)
         lastout = STDOUT_FILENO;
     }
 
-    if (fdmode & (DupStdin|DupStdout|DupStderr))
-        state.reader->add(shared_from_this());
+    if (fdmode & (DupStdin|DupStdout|DupStderr)) {
+        reader()->add(shared_from_this());
+        // the reader closes our end of stdin when it's done writing, we
+        // mustn't close it from here as well or we might hit a reused fd
+        mStdin = -1;
+    }
 
-    pid_t pid;
-    int e;
-    Process* start = &mProcs[0];
-    Process* proc = start;
-    Process* end = proc + mProcs.size();
+    if (!mProcs.empty())
+        mCommand = mProcs.front().path();
 
-    if (start != end)
-        mCommand = start->path();
+    // the reader forks the processes, we don't wait for them to exec
+    mLaunch.in = in;
+    mLaunch.out = lastout;
+    mLaunch.err = err;
+    mLaunch.pgid = is_interactive ? mPgid : -1;
+    mLaunch.foreground = is_interactive && m == Foreground;
+    mMode = m;
+    mStarting = true;
+    reader()->launch(shared_from_this());
+}
 
-    while (proc != end) {
-        if (proc + 1 != end) {
-            ::pipe(p);
+// runs on the reader thread. the children share our memory until they
+// exec so they're started one after the other, but without any round
+// trips to the loop thread in between. builtins are run right here
+void Job::launch()
+{
+    std::vector<Started> started;
+    std::string failure;
+    int in = mLaunch.in, error = 0, e;
+    pid_t pgid = mLaunch.pgid;
+
+    for (size_t i = 0; i < mProcs.size(); ++i) {
+        const bool last = (i + 1 == mProcs.size());
+        int p[2] = { -1, -1 }, out;
+        if (!last) {
+            ::pipe2(p, O_CLOEXEC);
             out = p[1];
         } else {
-            out = lastout;
+            out = mLaunch.out;
         }
 
-        // printf("forking\n");
-
-        // we'll need to notify the parent if we can't exec,
-        // create a pipe with CLOEXEC and write to it if
-        // we fail
-
-        int runpipe[2];
-        ::pipe(runpipe);
-        fcntl(runpipe[1], F_SETFD, fcntl(runpipe[1], F_GETFD) | FD_CLOEXEC);
-
-        pid = fork();
-        if (pid == 0) {
-            // close read end of runpipe
-            EINTRWRAP(e, ::close(runpipe[0]));
-            // make write end cloexec
-
-            // child
-            if (mStdin != -1) {
-                EINTRWRAP(e, ::close(mStdin));
-            }
-            if (mStdout != -1) {
-                EINTRWRAP(e, ::close(mStdout));
-            }
-            if (mStderr != -1) {
-                EINTRWRAP(e, ::close(mStderr));
+        const int fds[] = { in, out, mLaunch.err };
+        // start() hands us its own stdout and stderr unless it made pipes
+        // for them, a builtin only ever writes to pipes of the job
+        const uint8_t owned = ((!last || mLaunch.out != STDOUT_FILENO) ? Builtin::OwnStdout : 0)
+            | (mLaunch.err != STDERR_FILENO ? Builtin::OwnStderr : 0);
+        int status;
+        if (Builtin::run(mProcs[i], fds, owned, status)) {
+            bump(counters.builtins);
+            started.push_back({ 0, status, false });
+            if (in != STDIN_FILENO) {
+                EINTRWRAP(e, ::close(in));
             }
-            launch(proc, in, out, err, runpipe[1], m, is_interactive);
-        } else if (pid > 0) {
-            // parent
-            proc->mPid = pid;
-            if (is_interactive) {
-                if (!mPgid)
-                    mPgid = pid;
-                setpgid(pid, mPgid);
+            if (out != STDOUT_FILENO) {
+                EINTRWRAP(e, ::close(out));
             }
+            in = p[0];
+            continue;
+        }
 
-            bool ok = true;
-            // close write end of pipe and select on the read end
-            EINTRWRAP(e, ::close(runpipe[1]));
-
-            fd_set rdfds;
-            FD_ZERO(&rdfds);
-            FD_SET(runpipe[0], &rdfds);
-
-            EINTRWRAP(e, ::select(runpipe[0] + 1, &rdfds, 0, 0, 0));
-            if (e == -1) {
-                // horrible, abort the job
-                ok = false;
-            } else {
-                assert(e > 0);
-                assert(FD_ISSET(runpipe[0], &rdfds));
-                char c;
-                EINTRWRAP(e, ::read(runpipe[0], &c, 1));
-                if (e == -1 || e == 1) {
-                    // job went bad
-                    ok = false;
-                }
-            }
-            EINTRWRAP(e, ::close(runpipe[0]));
-
-            if (!ok) {
-                if (in != STDIN_FILENO) {
-                    EINTRWRAP(e, ::close(in));
-                }
-                if (out != STDOUT_FILENO) {
-                    EINTRWRAP(e, ::close(out));
-                }
-
-                auto job = shared_from_this();
-                mIoClosed.off();
-                mStateChanged.async(job, Failed, 0);
-                Job::sJobs.erase(job);
-
-                break;
-            }
-        } else {
-            // sad!
+        Spawn::Options opts;
+        opts.in = in;
+        opts.out = out;
+        opts.err = mLaunch.err;
+        opts.pgid = pgid;
+        opts.foreground = mLaunch.foreground;
+
+        Spawn spawn(mProcs[i], opts);
+        const pid_t pid = spawn.start();
+        if (pid > 0 && pgid != -1) {
+            if (!pgid)
+                pgid = pid;
+            setpgid(pid, pgid);
         }
 
         if (in != STDIN_FILENO) {
@@ -744,56 +1287,312 @@ void Job::start(Mode m, uint8_t fdmode)
             EINTRWRAP(e, ::close(out));
         }
 
+        if (pid <= 0) {
+            // job went bad, the child has been reaped already. the rest
+            // of the pipeline never starts so nothing writes to our stdout
+            error = spawn.error();
+            failure = spawn.errorString();
+            if (!last) {
+                EINTRWRAP(e, ::close(p[0]));
+                if (mLaunch.out != STDOUT_FILENO) {
+                    EINTRWRAP(e, ::close(mLaunch.out));
+                }
+            }
+            break;
+        }
+        bump(counters.processes);
+        started.push_back({ pid, 0, state.pidfds && reader()->watch(shared_from_this(), i, pid) });
         in = p[0];
-        ++proc;
     }
-    if (in != mStdout && in != STDIN_FILENO) {
-        EINTRWRAP(e, ::close(in));
+    if (mLaunch.err != STDERR_FILENO) {
+        EINTRWRAP(e, ::close(mLaunch.err));
     }
-    if (err != -1 && err != STDERR_FILENO) {
-        EINTRWRAP(e, ::close(err));
+
+    mLaunched(shared_from_this(), started, error, failure);
+}
+
+void Job::launched(const std::vector<Started>& started, int error, const std::string& failure)
+{
+    assert(started.size() <= mProcs.size());
+    mStarting = false;
+    auto job = shared_from_this();
+    for (size_t i = 0; i < started.size(); ++i) {
+        if (!started[i].pid) {
+            // a builtin, it's done already
+            updateState(mProcs[i], started[i].status);
+            continue;
+        }
+        mProcs[i].mPid = started[i].pid;
+        mProcs[i].mState = Process::Running;
+        sPids[started[i].pid] = { job, i, started[i].watched };
+        if (!started[i].watched)
+            ++sUnwatched;
+        if (mLaunch.pgid != -1 && !mPgid)
+            mPgid = started[i].pid;
     }
 
-    if (is_interactive)
-        setMode(m, false);
+    if (error) {
+        // whatever didn't start never will. the processes that did are
+        // still reaped, the job goes away once they're all gone
+        for (size_t i = started.size(); i < mProcs.size(); ++i)
+            mProcs[i].mState = Process::Terminated;
+        if (isTerminated()) {
+            mEndTime = uv_hrtime();
+            cancelTimeout();
+        }
+        mFailed = true;
+        mFailure = failure;
+        bump(counters.failed);
+        mStateChanged(job, Failed, error);
+        if (isTerminated() && isIoClosed())
+            sJobs.erase(job);
+    } else if (!mProcs.empty() && isTerminated()) {
+        // nothing but builtins, there's nothing for the waiter to reap
+        setStatus(mProcs.back().status());
+        if (isIoClosed()) {
+            bump(counters.finished);
+            mStateChanged(job, Terminated, mStatus);
+            sJobs.erase(job);
+        }
+    }
+
+    // no process group if no process was started
+    if (mLaunch.pgid != -1 && mPgid)
+        setMode(mMode, false);
+    if (mPendingSignal)
+        sendSignal(mPendingSignal);
+
+    // children that exited before we knew their pids
+    // have already had their SIGCHLD
+    JobWaiter::wake();
 }
 
 void Job::terminate()
 {
-    if (!isTerminated())
-        kill(-mPgid, SIGTERM);
+    sendSignal(SIGTERM);
 }
 
-void Job::init()
+void Job::sendSignal(int sig)
 {
-    state.reader.reset(new JobReader);
-    state.waiter.reset(new JobWaiter);
+    if (mStarting) {
+        mPendingSignal = sig;
+        return;
+    }
+    if (isTerminated())
+        return;
+    if (mPgid) {
+        kill(-mPgid, sig);
+        return;
+    }
+    // not interactive, the processes are in our own process group
+    for (const auto& proc : mProcs) {
+        if (proc.pid() && proc.state() != Process::Terminated)
+            kill(proc.pid(), sig);
+    }
+}
+
+void Job::setTimeout(uint64_t ms, int signal, uint64_t graceMs)
+{
+    cancelTimeout();
+    mTimeout = ms;
+    mTimeoutSignal = signal;
+    mTimeoutGrace = graceMs;
+    // not started yet, start() arms it
+    if (mTimeout && mStartTime && !mTimedOut && !isTerminated())
+        armTimeout(mTimeout);
+}
+
+void Job::armTimeout(uint64_t ms)
+{
+    // the wheel doesn't keep the job alive, sJobs does until it's done
+    std::weak_ptr<Job> weak = shared_from_this();
+    mTimer = TimerWheel::add(ms, [weak]() {
+            std::shared_ptr<Job> job = weak.lock();
+            if (!job)
+                return;
+            job->mTimer = TimerWheel::InvalidId;
+            if (job->isTerminated())
+                return;
+            if (!job->mTimedOut) {
+                job->mTimedOut = true;
+                bump(counters.timedOut);
+                job->mStateChanged(job, TimedOut, job->mTimeoutSignal);
+                job->sendSignal(job->mTimeoutSignal);
+                if (job->mTimeoutSignal != SIGKILL)
+                    job->armTimeout(job->mTimeoutGrace);
+            } else {
+                job->sendSignal(SIGKILL);
+            }
+        });
+}
 
-    state.reader->start();
+void Job::cancelTimeout()
+{
+    if (mTimer != TimerWheel::InvalidId) {
+        TimerWheel::remove(mTimer);
+        mTimer = TimerWheel::InvalidId;
+    }
+}
+
+void Job::init(size_t readers, bool pidfds)
+{
+    assert(readers > 0);
+    // pidfd_open() is older than waitid(P_PIDFD), we need both. waiting
+    // on ourselves says which one we have
+    state.pidfds = false;
+    if (pidfds) {
+        const int fd = openPidfd(getpid());
+        if (fd != -1) {
+            int status, e;
+            state.pidfds = !waitChild(IdPidfd, fd, WEXITED | WNOHANG, status, 0) && errno == ECHILD;
+            EINTRWRAP(e, ::close(fd));
+        }
+    }
+    for (size_t i = 0; i < readers; ++i) {
+        state.readers.push_back(std::make_shared<JobReader>());
+        state.readers.back()->start();
+    }
+    state.waiter.reset(new JobWaiter);
     state.waiter->start();
+    TimerWheel::init();
+}
+
+Job::Stats Job::stats()
+{
+    Stats stats;
+    stats.started = counters.started.load(std::memory_order_relaxed);
+    stats.finished = counters.finished.load(std::memory_order_relaxed);
+    stats.failed = counters.failed.load(std::memory_order_relaxed);
+    stats.timedOut = counters.timedOut.load(std::memory_order_relaxed);
+    stats.processes = counters.processes.load(std::memory_order_relaxed);
+    stats.builtins = counters.builtins.load(std::memory_order_relaxed);
+    stats.reaped = counters.reaped.load(std::memory_order_relaxed);
+    stats.sigchld = counters.sigchld.load(std::memory_order_relaxed);
+    stats.reapLatencyTotal = counters.reapLatencyTotal.load(std::memory_order_relaxed);
+    stats.reapLatencyMax = counters.reapLatencyMax.load(std::memory_order_relaxed);
+    stats.bytesRead = counters.bytesRead.load(std::memory_order_relaxed);
+    stats.bytesWritten = counters.bytesWritten.load(std::memory_order_relaxed);
+    stats.bytesSpliced = counters.bytesSpliced.load(std::memory_order_relaxed);
+    stats.jobs = sJobs.size();
+    stats.unreaped = sPids.size();
+    for (const auto& reader : state.readers)
+        stats.readers.push_back(reader->stats());
+    return stats;
+}
+
+std::vector<std::shared_ptr<Job> > Job::jobs()
+{
+    std::vector<std::shared_ptr<Job> > jobs(sJobs.begin(), sJobs.end());
+    std::sort(jobs.begin(), jobs.end(), [](const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b) {
+            return a->id() < b->id();
+        });
+    return jobs;
+}
+
+size_t Job::stdinQueued() const
+{
+    MutexLocker locker(&mStdinMutex);
+    return mStdinQueued;
+}
+
+bool Job::hasPidfds()
+{
+    return state.pidfds;
 }
 
 void Job::deinit()
 {
-    if (state.reader)
-        state.reader->stop();
-    state.reader.reset();
+    for (const auto& reader : state.readers)
+        reader->stop();
+    state.readers.clear();
     if (state.waiter)
         state.waiter->stop();
     state.waiter.reset();
+    TimerWheel::deinit();
 }
 
-void Job::write(const uint8_t* data, size_t len)
+void Job::delivered(size_t bytes)
 {
-    MutexLocker locker(&state.stdinMutex);
-    mStdinBuffer.add(data, len);
+    assert(mQueuedBytes >= bytes);
+    const size_t queued = mQueuedBytes.fetch_sub(bytes) - bytes;
+    if (queued <= mLowWatermark && !mPaused && mThrottled.exchange(false))
+        reader()->resume(shared_from_this());
+}
+
+void Job::pause()
+{
+    mPaused = true;
+}
+
+void Job::resume()
+{
+    mPaused = false;
+    if (mThrottled.exchange(false))
+        reader()->resume(shared_from_this());
+}
+
+JobReader* Job::reader() const
+{
+    assert(!state.readers.empty());
+    return state.readers[mShard % state.readers.size()].get();
+}
+
+size_t Job::readerIndex() const
+{
+    assert(!state.readers.empty());
+    return mShard % state.readers.size();
+}
+
+void Job::pipeTo(const std::shared_ptr<Job>& target)
+{
+    mPipeTarget = target;
+    target->mPipeSource = shared_from_this();
+    // the whole pipeline downstream of us shares our reader
+    for (auto t = target; t && t.get() != this; t = t->mPipeTarget.lock())
+        t->mShard = mShard;
+}
+
+Job::WriteStatus Job::write(const uint8_t* data, size_t len)
+{
+    WriteStatus status;
+    {
+        MutexLocker locker(&mStdinMutex);
+        if (mStdinClosed)
+            return WriteClosed;
+        if (len) {
+            mStdinChunks.push_back(StdinChunk { data, len });
+            mStdinQueued += len;
+        }
+        if (mStdinQueued >= StdinHighWatermark) {
+            mStdinNeedDrain = true;
+            status = WriteFull;
+        } else {
+            status = WriteOk;
+        }
+    }
+    if (len)
+        reader()->stdinChanged(shared_from_this());
+    return status;
 }
 
 void Job::close()
 {
     {
-        MutexLocker locker(&state.stdinMutex);
+        MutexLocker locker(&mStdinMutex);
+        mStdinClosed = true;
+    }
+    reader()->stdinChanged(shared_from_this());
+}
+
+void Job::discardStdin()
+{
+    {
+        MutexLocker locker(&mStdinMutex);
         mStdinClosed = true;
+        mStdinNeedDrain = false;
+        mStdinChunks.clear();
+        mStdinOffset = mStdinQueued = 0;
     }
-    state.reader->wakeup();
+    if (!state.readers.empty())
+        reader()->stdinChanged(shared_from_this());
 }
@@ -4,26 +4,37 @@
 #include "Process.h"
 #include "Signal.h"
 #include "Buffer.h"
+#include "TimerWheel.h"
 #include <assert.h>
 #include <vector>
+#include <deque>
 #include <unordered_set>
+#include <unordered_map>
 #include <memory>
+#include <atomic>
 #include <unistd.h>
+#include <signal.h>
 
+class JobReader;
 class JobWaiter;
 
 class Job : public std::enable_shared_from_this<Job>
 {
 public:
     Job()
-        : mPgid(0), mStdin(0), mStdout(0), mStderr(0),
-          mStatus(0), mNotified(false), mStdinClosed(false), mMode(Foreground)
+        : mId(sNextId++), mShard(mId), mPgid(0), mStartTime(0), mEndTime(0), mStdin(0), mStdout(0), mStderr(0),
+          mStatus(0), mNotified(false), mFailed(false), mStarting(false), mPendingSignal(0),
+          mTimeout(0), mTimeoutGrace(DefaultTimeoutGrace), mTimeoutSignal(SIGTERM), mTimer(TimerWheel::InvalidId), mTimedOut(false), mCapture(0), mStdinClosed(false), mStdinNeedDrain(false),
+          mStdinOffset(0), mStdinQueued(0), mStdinBytes(0), mStdoutBytes(0), mStderrBytes(0), mPipeTee(false),
+          mQueuedBytes(0), mHighWatermark(DefaultHighWatermark), mLowWatermark(DefaultLowWatermark),
+          mPaused(false), mThrottled(false), mCoalesceBytes(0), mCoalesceUsecs(0),
+          mDelimiter(NoDelimiter), mMode(Foreground)
     {
     }
 
     ~Job()
     {
-        assert(isTerminated());
+        assert(mFailed || isTerminated());
         if (mStdin != -1)
             ::close(mStdin);
     }
@@ -34,11 +45,71 @@ public:
     void setMode(Mode m, bool resume);
 
     enum FdMode { DupStdin = 0x1, DupStdout = 0x2, DupStderr = 0x4 };
+    // capture keeps all of stdout natively and posts it once when the
+    // job closes it, for command substitution. implies DupStdout
+    enum CaptureMode { CaptureStdout = 0x8, CaptureTrimNewlines = 0x10 };
+    // returns right away, the processes are started by the reader thread.
+    // if one of them can't be started the job goes to Failed
     void start(Mode m, uint8_t fdmode = 0);
     void terminate();
 
-    void write(const uint8_t* data, size_t len);
+    // once ms have passed since start(), or since now if it has been
+    // started, the job goes to TimedOut and its processes get signal. if
+    // they're still around graceMs after that they get SIGKILL. 0 ms
+    // takes the deadline away again
+    enum { DefaultTimeoutGrace = 5000 };
+    void setTimeout(uint64_t ms, int signal = SIGTERM, uint64_t graceMs = DefaultTimeoutGrace);
+    bool isTimedOut() const { return mTimedOut; }
+
+    // queues data for stdin without copying it. the memory is owned by the
+    // caller and has to stay valid until stdinWritten() has reported it as
+    // done, or until discardStdin(). WriteFull means that the data was queued
+    // but the caller should wait for a drain before writing more
+    enum { StdinHighWatermark = 64 * 1024 };
+    enum WriteStatus { WriteOk, WriteFull, WriteClosed };
+    WriteStatus write(const uint8_t* data, size_t len);
     void close();
+    // closes stdin and drops everything still queued, once this returns
+    // the reader no longer touches any memory passed to write()
+    void discardStdin();
+
+    // feed our stdout into the stdin of target. the reader moves the data
+    // between the two pipes with splice(), or with tee() if pipe tee is on
+    // and our stdout listeners should still see the data. target is moved
+    // onto our reader thread so that both ends are handled by the same one.
+    // must be called before either job is started. pipe tee can be
+    // turned on and off at any time
+    void pipeTo(const std::shared_ptr<Job>& target);
+    void setPipeTee(bool tee) { mPipeTee = tee; }
+
+    // flow control for stdout/stderr. output that has been read but not
+    // yet delivered counts as queued, above the high watermark the reader
+    // stops reading until we're back under the low watermark. the kernel
+    // pipe then fills up and the producer blocks
+    enum { DefaultHighWatermark = 1024 * 1024, DefaultLowWatermark = 256 * 1024 };
+    void setWatermarks(size_t high, size_t low) { mHighWatermark = high; mLowWatermark = low; }
+    size_t queuedBytes() const { return mQueuedBytes.load(); }
+    // must be called on the loop thread once queued output was handed on,
+    // by every stdout()/stderr() listener for every buffer it is given.
+    // output that is emitted while there are no listeners isn't counted
+    void delivered(size_t bytes);
+    void pause();
+    void resume();
+    bool isPaused() const { return mPaused.load(); }
+    bool isCapturing() const { return mCapture & CaptureStdout; }
+
+    // coalescing, output is held back until at least bytes have been read
+    // or the oldest of it is usecs old, whichever comes first. usecs of 0
+    // turns it off and every read is posted right away, bytes of 0 means
+    // that only the time counts
+    void setCoalesce(size_t bytes, uint32_t usecs) { mCoalesceBytes = bytes; mCoalesceUsecs = usecs; }
+
+    // record mode, output is only posted up to and including the last
+    // delimiter. a partial record at the end is held back until the
+    // rest of it arrives or the fd is closed
+    enum { NoDelimiter = -1 };
+    void setDelimiter(int delim) { mDelimiter = delim; }
+    int delimiter() const { return mDelimiter; }
 
     bool isStopped() const;
     bool isTerminated() const;
@@ -48,37 +119,166 @@ public:
     int status() const { return mStatus; }
 
     std::string command() const { return mCommand; }
+    const std::vector<Process>& processes() const { return mProcs; }
 
-    static void init();
+    // what its processes have used so far, summed up. maxRss
+    // is the largest one, they don't necessarily overlap
+    Process::Usage usage() const;
+    // microseconds from start() until the last process
+    // terminated, or until now if that hasn't happened yet
+    uint64_t elapsed() const;
+    // why the job went to Failed, the status is the errno
+    const std::string& failure() const { return mFailure; }
+
+    // jobs are spread over the reader threads by id, all io for
+    // one job always happens on the same reader
+    uint32_t id() const { return mId; }
+    size_t readerIndex() const;
+    pid_t pgid() const { return mPgid; }
+    // still waiting for the reader to start its processes
+    bool isStarting() const { return mStarting; }
+    bool isThrottled() const { return mThrottled.load(); }
+
+    // bytes that went through each of the pipes so far, stdout
+    // includes what was spliced on to a pipe target
+    uint64_t stdinBytes() const { return mStdinBytes.load(std::memory_order_relaxed); }
+    uint64_t stdoutBytes() const { return mStdoutBytes.load(std::memory_order_relaxed); }
+    uint64_t stderrBytes() const { return mStderrBytes.load(std::memory_order_relaxed); }
+    // bytes passed to write() that the reader hasn't written yet
+    size_t stdinQueued() const;
+
+    enum { DefaultReaders = 1 };
+    // pidfds false has processes reaped on SIGCHLD only, as it is
+    // on kernels that don't have them
+    static void init(size_t readers = DefaultReaders, bool pidfds = true);
     static void deinit();
+    static bool hasPidfds();
 
-    enum State { Stopped, Terminated, Failed };
+    // counters since init(), they're relaxed so a snapshot may be a
+    // little inconsistent. reap latency is in microseconds, from the
+    // exit being noticed until the job had it
+    struct Stats
+    {
+        uint64_t started, finished, failed, timedOut;
+        uint64_t processes, builtins, reaped, sigchld;
+        uint64_t reapLatencyTotal, reapLatencyMax;
+        uint64_t bytesRead, bytesWritten, bytesSpliced;
+        size_t jobs, unreaped;
+        struct Reader
+        {
+            size_t jobs, fds, pidfds;
+            uint64_t wakeups;
+        };
+        std::vector<Reader> readers;
+    };
+    // only to be called on the loop thread, as is jobs()
+    static Stats stats();
+    // every job that has been started and isn't done, by id
+    static std::vector<std::shared_ptr<Job> > jobs();
+
+    // a job that times out still goes to Terminated
+    // once its processes are gone
+    enum State { Stopped, Terminated, Failed, TimedOut };
     enum Io { Stdout, Stderr };
     Signal<std::function<void(const std::shared_ptr<Job>&, State, int)> >& stateChanged() { return mStateChanged; }
     Signal<std::function<void(const std::shared_ptr<Job>&, Buffer&)> >& stdout() { return mStdoutSignal; }
     Signal<std::function<void(const std::shared_ptr<Job>&, Buffer&)> >& stderr() { return mStderrSignal; }
     Signal<std::function<void(const std::shared_ptr<Job>&, Io io)> >& ioClosed() { return mIoClosed; }
+    // number of write() chunks that are done with, in write() order, and
+    // whether the stdin queue drained after a write() returned WriteFull
+    Signal<std::function<void(const std::shared_ptr<Job>&, size_t, bool)> >& stdinWritten() { return mStdinWritten; }
 
 private:
-    void updateState(Process& pid, int status);
-    void launch(Process* proc, int in, int out, int err, int notif, Mode m, bool is_interactive);
+    JobReader* reader() const;
+    // to the process group, or to each process if there is none
+    void sendSignal(int sig);
+    void armTimeout(uint64_t ms);
+    void cancelTimeout();
+    void updateState(Process& pid, int status, const struct rusage* usage = 0);
+    void launch();
+    // what launch() did with a process. builtins run right there and
+    // have no pid, only a status. a watched process has a pidfd on the
+    // reader thread, which reaps it when it exits
+    struct Started
+    {
+        pid_t pid;
+        int status;
+        bool watched;
+    };
+    void launched(const std::vector<Started>& started, int error, const std::string& failure);
+    // the process at index was reaped, by the waiter or by the reader
+    // seen is the uv_hrtime() of when the exit was noticed
+    void reaped(size_t index, int status, const struct rusage& usage, uint64_t seen);
 
 private:
-    std::string mCommand;
+    uint32_t mId, mShard;
+    std::string mCommand, mFailure;
     std::vector<Process> mProcs;
-    Buffer mStdinBuffer;
     pid_t mPgid;
+    uint64_t mStartTime, mEndTime;
     struct termios mTmodes;
     int mStdin, mStdout, mStderr;
     int mStatus;
     bool mNotified;
-    bool mStdinClosed;
+    bool mFailed;
+    // between start() and the reader reporting back the pids
+    bool mStarting;
+    // sent once the pids are known
+    int mPendingSignal;
+    uint64_t mTimeout, mTimeoutGrace;
+    int mTimeoutSignal;
+    TimerWheel::Id mTimer;
+    bool mTimedOut;
+    uint8_t mCapture;
+
+    // what start() hands to launch(), owned by the reader until then
+    struct
+    {
+        int in, out, err;
+        pid_t pgid;
+        bool foreground;
+    } mLaunch;
+
+    // stdin state, shared with the reader and protected by mStdinMutex
+    struct StdinChunk
+    {
+        const uint8_t* data;
+        size_t size;
+    };
+    mutable Mutex mStdinMutex;
+    bool mStdinClosed, mStdinNeedDrain;
+    std::deque<StdinChunk> mStdinChunks;
+    size_t mStdinOffset, mStdinQueued;
+    std::atomic<uint64_t> mStdinBytes, mStdoutBytes, mStderrBytes;
+
+    std::weak_ptr<Job> mPipeTarget, mPipeSource;
+    std::atomic<bool> mPipeTee;
+    std::atomic<size_t> mQueuedBytes;
+    std::atomic<size_t> mHighWatermark, mLowWatermark;
+    std::atomic<bool> mPaused, mThrottled;
+    std::atomic<size_t> mCoalesceBytes;
+    std::atomic<uint32_t> mCoalesceUsecs;
+    std::atomic<int> mDelimiter;
     Mode mMode;
     Signal<std::function<void(const std::shared_ptr<Job>&, State, int)> > mStateChanged;
     Signal<std::function<void(const std::shared_ptr<Job>&, Buffer&)> > mStdoutSignal, mStderrSignal;
     Signal<std::function<void(const std::shared_ptr<Job>&, Io io)> > mIoClosed;
+    Signal<std::function<void(const std::shared_ptr<Job>&, size_t, bool)> > mStdinWritten;
+    Signal<std::function<void(const std::shared_ptr<Job>&, const std::vector<Started>&, int, const std::string&)> > mLaunched;
+    Signal<std::function<void(const std::shared_ptr<Job>&, size_t, int, const struct rusage&, uint64_t)> > mReaped;
 
     static std::unordered_set<std::shared_ptr<Job> > sJobs;
+    // every child we have yet to reap
+    struct Child
+    {
+        std::shared_ptr<Job> job;
+        size_t index;
+        bool watched;
+    };
+    static std::unordered_map<pid_t, Child> sPids;
+    // how many of them the waiter has to reap even though we have pidfds
+    static size_t sUnwatched;
+    static std::atomic<uint32_t> sNextId;
 
     friend class JobWaiter;
     friend class JobReader;
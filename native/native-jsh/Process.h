@@ -4,38 +4,91 @@
 #include <unordered_map>
 #include <vector>
 #include <functional>
+#include <stdint.h>
 #include "Signal.h"
+#include "Environment.h"
 
 class Job;
 
 class Process
 {
 public:
-    typedef std::unordered_map<std::string, std::string> Environ;
+    // variables set for this process only, on top of its environment
+    typedef Environment::Map Environ;
     typedef std::vector<std::string> Args;
     struct Redirect
     {
+        // Read opens file for reading, Document makes file itself what
+        // fromfd reads. a redirect to another fd (>& and <&) has tofd set
+        // and no file
+        enum Mode { Write, Append, Read, Document };
         int fromfd, tofd;
         std::string file;
-        bool append;
+        Mode mode;
     };
     typedef std::vector<Redirect> Redirects;
+    // how the process is to be run, applied before it execs
+    struct Attributes
+    {
+        Attributes()
+            : hasNice(false), nice(0), ioprio(-1)
+        {
+        }
+
+        // the cpus it may run on, empty for the ones we may run on
+        std::vector<int> affinity;
+        // the niceness to set, not relative to ours
+        bool hasNice;
+        int nice;
+        // as for ioprio_set(), the class shifted up 13 bits or'ed with
+        // the level, -1 to leave it alone
+        int ioprio;
+        // RLIMIT_* resource, RLIM_INFINITY for no limit
+        struct Limit
+        {
+            int resource;
+            uint64_t soft, hard;
+        };
+        std::vector<Limit> limits;
+        // cgroup directory to move into
+        std::string cgroup;
+    };
+
+    // what the process used, from wait4(). times are in microseconds,
+    // rss in kilobytes. the kernel keeps the rss high water mark across
+    // execve(), a process we started ourselves with our memory shared
+    // reports at least our rss there. the zygote's are much smaller
+    struct Usage
+    {
+        uint64_t user, system;
+        long maxRss;
+        long minorFaults, majorFaults;
+        long voluntarySwitches, involuntarySwitches;
+    };
 
     Process(const std::string& path)
-        : mPath(path), mState(Created), mPid(0), mStatus(0)
+        : mPath(path), mState(Created), mPid(0), mStatus(0), mUsage()
     {
     }
 
-    void setEnviron(Environ&& environ) { mEnviron = std::forward<Environ>(environ); }
+    void setEnviron(const std::shared_ptr<const Environment::Snapshot>& environ) { mEnviron = environ; }
+    void setAssigns(Environ&& assigns) { mAssigns = std::forward<Environ>(assigns); }
     void setArgs(Args&& args) { mArgs = std::forward<Args>(args); }
     void setRedirects(Redirects&& redirs) { mRedirs = std::forward<Redirects>(redirs); }
+    void setAttributes(Attributes&& attrs) { mAttributes = std::forward<Attributes>(attrs); }
 
     const std::string& path() const { return mPath; }
-    const Environ& environ() const { return mEnviron; }
+    const std::shared_ptr<const Environment::Snapshot>& environ() const { return mEnviron; }
+    const Environ& assigns() const { return mAssigns; }
+    // what key will be set to for the process
+    std::string env(const std::string& key) const;
     const Args& args() const { return mArgs; }
     const Redirects& redirs() const { return mRedirs; }
+    const Attributes& attributes() const { return mAttributes; }
     pid_t pid() const { return mPid; }
     int status() const { return mStatus; }
+    // all zero until the process has terminated, and for builtins
+    const Usage& usage() const { return mUsage; }
 
     enum State { Created, Running, Stopped, Terminated };
     State state() const { return mState; }
@@ -44,16 +97,28 @@ public:
 
 private:
     std::string mPath;
-    Environ mEnviron;
+    std::shared_ptr<const Environment::Snapshot> mEnviron;
+    Environ mAssigns;
     Args mArgs;
     Redirects mRedirs;
+    Attributes mAttributes;
     State mState;
     pid_t mPid;
     int mStatus;
+    Usage mUsage;
 
     Signal<std::function<void(Process*, State)> > mStateChanged;
 
     friend class Job;
 };
 
+inline std::string Process::env(const std::string& key) const
+{
+    auto it = mAssigns.find(key);
+    if (it != mAssigns.end())
+        return it->second;
+    const char* value = mEnviron ? mEnviron->get(key) : 0;
+    return value ? value : std::string();
+}
+
 #endif
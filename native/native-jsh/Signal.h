@@ -1,11 +1,17 @@
 #ifndef SIGNAL_H
 #define SIGNAL_H
 
-#include <unordered_map>
+#include <vector>
+#include <memory>
 #include <tuple>
 #include "SignalBase.h"
 #include "utils.h"
 
+// the listeners are kept as an immutable snapshot that on() and off()
+// replace, emitting only takes a reference to the current one. a call
+// posted to the loop thread holds on to the snapshot it was emitted
+// with, so a listener that is removed in the meantime still gets it.
+// all listeners of one posted emit share a single copy of the arguments
 template<typename Functor>
 class Signal : protected SignalBase
 {
@@ -19,20 +25,43 @@ public:
     bool off(Key key);
     void off();
 
+    // false if there was no listener to call
     template<typename... Args>
-    void operator()(Args&&... args) const;
+    bool operator()(Args&&... args) const;
 
     template<typename... Args>
     void async(Args&&... args) const;
 
 private:
-    std::unordered_map<Key, Functor> mFuncs;
-    Mode mMode;
-    Key mNextKey;
+    typedef std::vector<std::pair<Key, Functor> > Funcs;
+    typedef std::shared_ptr<const Funcs> Snapshot;
+
+    template<typename... Args>
+    struct Emit : public CallBase
+    {
+        typedef std::tuple<typename std::remove_reference<Args>::type...> Decayed;
 
-    // this should possibly be static,
-    // bit of a waste to have one mutex per signal
-    mutable Mutex mMutex;
+        Emit(const Snapshot& f, Args... a)
+            : funcs(f), args(std::forward<Args>(a)...)
+        {
+        }
+
+        virtual void call() override
+        {
+            for (const auto& f : *funcs)
+                apply(args, f.second);
+        }
+
+        Snapshot funcs;
+        Decayed args;
+    };
+
+    // to be called with the listener mutex held
+    void replace(Funcs&& funcs);
+
+    Snapshot mFuncs;
+    const Mode mMode;
+    Key mNextKey;
 };
 
 template<typename Functor>
@@ -41,68 +70,79 @@ Signal<Functor>::Signal(Mode m)
 {
 }
 
+template<typename Functor>
+void Signal<Functor>::replace(Funcs&& funcs)
+{
+    Snapshot snapshot;
+    if (!funcs.empty())
+        snapshot = std::make_shared<const Funcs>(std::forward<Funcs>(funcs));
+    std::atomic_store(&mFuncs, snapshot);
+}
+
 template<typename Functor>
 typename Signal<Functor>::Key Signal<Functor>::on(Functor&& func)
 {
-    MutexLocker locker(&mMutex);
-    Key k = mNextKey++;
-    mFuncs[k] = std::forward<Functor>(func);
+    MutexLocker locker(&listenerMutex());
+    Funcs funcs;
+    if (mFuncs)
+        funcs = *mFuncs;
+    const Key k = mNextKey++;
+    funcs.emplace_back(k, std::forward<Functor>(func));
+    replace(std::move(funcs));
     return k;
 }
 
 template<typename Functor>
 bool Signal<Functor>::off(Key key)
 {
-    MutexLocker locker(&mMutex);
-    auto it = mFuncs.find(key);
-    if (it == mFuncs.end())
+    MutexLocker locker(&listenerMutex());
+    if (!mFuncs)
+        return false;
+    Funcs funcs;
+    funcs.reserve(mFuncs->size());
+    for (const auto& f : *mFuncs) {
+        if (f.first != key)
+            funcs.push_back(f);
+    }
+    if (funcs.size() == mFuncs->size())
         return false;
-    mFuncs.erase(it);
+    replace(std::move(funcs));
     return true;
 }
 
 template<typename Functor>
 void Signal<Functor>::off()
 {
-    MutexLocker locker(&mMutex);
-    mFuncs.clear();
+    MutexLocker locker(&listenerMutex());
+    replace(Funcs());
 }
 
 template<typename Functor>
 template<typename... Args>
-void Signal<Functor>::operator()(Args&&... args) const
+bool Signal<Functor>::operator()(Args&&... args) const
 {
-    std::unordered_map<Key, Functor> funcs;
-    Mode mode;
-    {
-        MutexLocker locker(&mMutex);
-        mode = mMode;
-        funcs = mFuncs;
-    }
-    if (mode == Posted && !isLoopThread()) {
-        for (auto& f : funcs) {
-            call(SignalBase::Call<Functor, Args...>(std::move(f.second), std::forward<Args>(args)...));
-        }
+    const Snapshot funcs = std::atomic_load(&mFuncs);
+    if (!funcs)
+        return false;
+    if (mMode == Posted && !isLoopThread()) {
+        call(new Emit<Args...>(funcs, std::forward<Args>(args)...));
     } else {
-        for (auto& f : funcs) {
+        for (const auto& f : *funcs) {
             std::tuple<typename std::remove_reference<Args>::type...> tup(std::forward<Args>(args)...);
             apply(tup, f.second);
         }
     }
+    return true;
 }
 
 template<typename Functor>
 template<typename... Args>
 void Signal<Functor>::async(Args&&... args) const
 {
-    std::unordered_map<Key, Functor> funcs;
-    {
-        MutexLocker locker(&mMutex);
-        funcs = mFuncs;
-    }
-    for (auto& f : funcs) {
-        call(SignalBase::Call<Functor, Args...>(std::move(f.second), std::forward<Args>(args)...));
-    }
+    const Snapshot funcs = std::atomic_load(&mFuncs);
+    if (!funcs)
+        return;
+    call(new Emit<Args...>(funcs, std::forward<Args>(args)...));
 }
 
 #endif
@@ -1,13 +1,20 @@
 #include "SignalBase.h"
 #include "utils.h"
 #include <unordered_map>
+#include <atomic>
 
 struct {
     Mutex mutex;
-    std::unordered_map<const SignalBase*, std::vector<SignalBase::CallBase*> > calls;
+    // one queue for every signal so that calls are made in the order
+    // they were posted, a job's stdout must not overtake its ioClosed
+    std::vector<std::pair<const SignalBase*, SignalBase::CallBase*> > calls;
 
     uv_async_t async;
     uv_thread_t mainThread;
+
+    std::atomic<uint64_t> posted, called, dropped, wakeups;
+
+    Mutex listeners;
 } static state;
 
 void SignalBase::init()
@@ -15,20 +22,17 @@ void SignalBase::init()
     MutexLocker locker(&state.mutex);
     state.mainThread = uv_thread_self();
     uv_async_init(uv_default_loop(), &state.async, [](uv_async_t*) {
-            std::unordered_map<const SignalBase*, std::vector<SignalBase::CallBase*> > calls;
+            std::vector<std::pair<const SignalBase*, SignalBase::CallBase*> > calls;
             {
                 MutexLocker locker(&state.mutex);
                 std::swap(state.calls, calls);
             }
 
-            auto base = calls.begin();
-            const auto end = calls.cend();
-            while (base != end) {
-                for (const auto& c : base->second) {
-                    c->call();
-                    delete c;
-                }
-                ++base;
+            state.wakeups.fetch_add(1, std::memory_order_relaxed);
+            state.called.fetch_add(calls.size(), std::memory_order_relaxed);
+            for (const auto& c : calls) {
+                c.second->call();
+                delete c.second;
             }
         });
 }
@@ -40,7 +44,31 @@ void SignalBase::deinit()
 void SignalBase::removeBase(SignalBase* base)
 {
     MutexLocker locker(&state.mutex);
-    state.calls.erase(base);
+    auto it = state.calls.begin();
+    while (it != state.calls.end()) {
+        if (it->first == base) {
+            state.dropped.fetch_add(1, std::memory_order_relaxed);
+            delete it->second;
+            it = state.calls.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+SignalBase::Stats SignalBase::stats()
+{
+    Stats stats;
+    stats.posted = state.posted.load(std::memory_order_relaxed);
+    stats.called = state.called.load(std::memory_order_relaxed);
+    stats.dropped = state.dropped.load(std::memory_order_relaxed);
+    stats.wakeups = state.wakeups.load(std::memory_order_relaxed);
+    return stats;
+}
+
+Mutex& SignalBase::listenerMutex()
+{
+    return state.listeners;
 }
 
 bool SignalBase::isLoopThread()
@@ -53,7 +81,9 @@ void SignalBase::call(CallBase* base) const
 {
     {
         MutexLocker locker(&state.mutex);
-        state.calls[this].push_back(base);
+        state.calls.push_back(std::make_pair(this, base));
+        // under the lock, so that called never gets ahead of it
+        state.posted.fetch_add(1, std::memory_order_relaxed);
     }
     uv_async_send(const_cast<uv_async_t*>(&state.async));
 }
@@ -5,6 +5,8 @@
 #include <uv.h>
 #include "apply.h"
 
+class Mutex;
+
 class SignalBase
 {
 public:
@@ -16,54 +18,27 @@ public:
 
     static bool isLoopThread();
 
+    // calls posted to the loop thread, made there or dropped because
+    // their signal went away, and how often the loop thread woke up
+    struct Stats
+    {
+        uint64_t posted, called, dropped, wakeups;
+    };
+    static Stats stats();
+
     struct CallBase
     {
         virtual ~CallBase() { }
 
         virtual void call() = 0;
-        virtual CallBase* take() = 0;
     };
 
 protected:
-    template<typename Functor, typename... Args>
-    struct Call : public CallBase
-    {
-    public:
-        typedef std::tuple<typename std::remove_reference<Args>::type...> Decayed;
-
-        Call(Functor&& f, Decayed&& a)
-            : func(std::forward<Functor>(f)),
-              args(std::forward<Decayed>(a))
-        {
-        }
-
-        Call(Functor&& f, Args... a)
-            : func(std::forward<Functor>(f)),
-              args(std::forward<Args>(a)...)
-        {
-        }
-
-        virtual void call() override
-        {
-            apply(args, func);
-        }
-
-        virtual CallBase* take() override
-        {
-            auto taken = new Call<Functor, Args...>(std::move(func), std::move(args));
-            return taken;
-        }
-
-        Functor func;
-        Decayed args;
-    };
-
-    void call(CallBase&& base) const
-    {
-        call(base.take());
-    }
     void call(CallBase* base) const;
 
+    // one for every signal, on() and off() are rare and short
+    static Mutex& listenerMutex();
+
 private:
     static void removeBase(SignalBase* base);
 };
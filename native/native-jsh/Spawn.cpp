@@ -0,0 +1,390 @@
+#include "Spawn.h"
+#include "CommandHash.h"
+#include "Zygote.h"
+#include "utils.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+enum { IoprioWhoProcess = 1 };
+
+Spawn::Spawn(const Process& proc, const Options& opts)
+    : mOpts(opts), mCommand(proc.path()), mCwd(0), mPath(0), mArgv(0), mEnvp(0),
+      mActions(0), mActionCount(0), mAttributes(), mCgroup(0), mError(0), mFailure(NoFailure),
+      mStep(NoStep)
+{
+    compile(proc);
+}
+
+Spawn::Spawn()
+    : mOpts({ -1, -1, -1, -1, false }), mCwd(0), mPath(0), mArgv(0), mEnvp(0),
+      mActions(0), mActionCount(0), mAttributes(), mCgroup(0), mError(0), mFailure(NoFailure),
+      mStep(NoStep)
+{
+}
+
+Spawn::~Spawn()
+{
+    int e;
+    for (int fd : mFiles) {
+        EINTRWRAP(e, ::close(fd));
+    }
+}
+
+int Spawn::document(const std::string& data)
+{
+    // the whole document goes into one sealed memfd, the child reads it like
+    // any file and nothing has to feed it through a pipe while it runs
+    const int fd = ::memfd_create("jsh-here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+        return -1;
+    bool ok = true;
+    size_t written = 0;
+    while (ok && written < data.size()) {
+        ssize_t w;
+        EINTRWRAP(w, ::write(fd, data.data() + written, data.size() - written));
+        if (w == -1)
+            ok = false;
+        else
+            written += w;
+    }
+    if (ok)
+        ok = ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0
+            && ::lseek(fd, 0, SEEK_SET) == 0;
+    if (!ok) {
+        const int err = errno;
+        int e;
+        EINTRWRAP(e, ::close(fd));
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+void Spawn::compile(const Process& proc)
+{
+    // we need to find proc.path() in $PATH, if it's not there
+    // we don't need to start anything to know that it won't run
+    const std::string path = CommandHash::find(proc.env("PATH"), proc.path());
+    if (path.empty()) {
+        mError = ENOENT;
+        mFailure = NotFound;
+        return;
+    }
+
+    // redirect files are opened here so that a failure can say which
+    // one it was. they're close-on-exec, the child only gets its dups.
+    // they go above every fd the redirects name, or a dup2() to one of
+    // those could replace a file before its own dup2() has used it
+    const auto& redirs = proc.redirs();
+    std::vector<int> files(redirs.size(), -1);
+    int highest = STDERR_FILENO;
+    for (const auto& redir : redirs)
+        highest = std::max(highest, std::max(redir.fromfd, redir.tofd));
+    for (size_t i = 0; i < redirs.size(); ++i) {
+        const auto& redir = redirs[i];
+        if (redir.tofd != -1)
+            continue;
+        switch (redir.mode) {
+        case Process::Redirect::Write:
+        case Process::Redirect::Append: {
+            const int oflag = O_WRONLY | O_CREAT | O_CLOEXEC | (redir.mode == Process::Redirect::Append ? O_APPEND : O_TRUNC);
+            EINTRWRAP(files[i], ::open(redir.file.c_str(), oflag, 0666));
+            break; }
+        case Process::Redirect::Read:
+            EINTRWRAP(files[i], ::open(redir.file.c_str(), O_RDONLY | O_CLOEXEC));
+            break;
+        case Process::Redirect::Document:
+            files[i] = document(redir.file);
+            break;
+        }
+        if (files[i] != -1 && files[i] <= highest) {
+            const int moved = ::fcntl(files[i], F_DUPFD_CLOEXEC, highest + 1);
+            const int err = errno;
+            int e;
+            EINTRWRAP(e, ::close(files[i]));
+            files[i] = moved;
+            errno = err;
+        }
+        if (files[i] == -1) {
+            mError = errno;
+            mFailure = Redirect;
+            mFailedFile = redir.mode == Process::Redirect::Document ? "here-document" : redir.file;
+            return;
+        }
+        mFiles.push_back(files[i]);
+    }
+
+    std::vector<FdAction> actions;
+    auto stdio = [&actions](int fd, int target) {
+        if (fd != target) {
+            actions.push_back({ FdAction::Dup, fd, target });
+            actions.push_back({ FdAction::Close, fd, -1 });
+        }
+    };
+    stdio(mOpts.in, STDIN_FILENO);
+    stdio(mOpts.out, STDOUT_FILENO);
+    stdio(mOpts.err, STDERR_FILENO);
+    // node opens its own stdio close-on-exec, whatever we inherit
+    // rather than dup2 must have that cleared or the child loses it.
+    // before the redirects, those may replace them
+    if (mOpts.in == STDIN_FILENO)
+        actions.push_back({ FdAction::Inherit, STDIN_FILENO, -1 });
+    if (mOpts.out == STDOUT_FILENO)
+        actions.push_back({ FdAction::Inherit, STDOUT_FILENO, -1 });
+    if (mOpts.err == STDERR_FILENO)
+        actions.push_back({ FdAction::Inherit, STDERR_FILENO, -1 });
+    for (size_t i = 0; i < redirs.size(); ++i) {
+        const int fd = redirs[i].tofd != -1 ? redirs[i].tofd : files[i];
+        if (fd != redirs[i].fromfd)
+            actions.push_back({ FdAction::Dup, fd, redirs[i].fromfd });
+        else if (files[i] != -1)
+            actions.push_back({ FdAction::Inherit, fd, -1 });
+    }
+
+    const auto& attrs = proc.attributes();
+    mAttributes.affinity = !attrs.affinity.empty();
+    CPU_ZERO(&mAttributes.cpus);
+    for (int cpu : attrs.affinity)
+        CPU_SET(cpu, &mAttributes.cpus);
+    mAttributes.nice = attrs.hasNice;
+    mAttributes.niceValue = attrs.nice;
+    mAttributes.ioprio = attrs.ioprio;
+    mAttributes.umask = -1;
+    for (const auto& limit : attrs.limits) {
+        if (mAttributes.limitCount == RLIM_NLIMITS)
+            break;
+        auto& l = mAttributes.limits[mAttributes.limitCount++];
+        l.resource = limit.resource;
+        l.limit.rlim_cur = limit.soft;
+        l.limit.rlim_max = limit.hard;
+    }
+    const std::string cgroup = attrs.cgroup.empty() ? std::string() : attrs.cgroup + "/cgroup.procs";
+
+    // the environment is shared as is unless this process has
+    // variables of its own, then it gets its own pointer array
+    const auto& args = proc.args();
+    const auto& assigns = proc.assigns();
+    mEnviron = proc.environ();
+    const size_t environSize = mEnviron ? mEnviron->size() : 0;
+
+    const size_t argvCount = args.size() + 2;
+    const size_t envpCount = assigns.empty() ? 0 : environSize + assigns.size() + 1;
+    size_t strBytes = path.size() + 1 + proc.path().size() + 1 + cgroup.size() + 1;
+    for (const auto& arg : args)
+        strBytes += arg.size() + 1;
+    for (const auto& assign : assigns)
+        strBytes += assign.first.size() + assign.second.size() + 2;
+
+    // pointers first, then the fd actions and the strings last so
+    // that everything is aligned without any padding
+    const size_t size = (argvCount + envpCount) * sizeof(char*) + actions.size() * sizeof(FdAction) + strBytes;
+    mArena.reset(new char[size]);
+    char** argv = reinterpret_cast<char**>(mArena.get());
+    char** envp = argv + argvCount;
+    FdAction* acts = reinterpret_cast<FdAction*>(envp + envpCount);
+    char* str = reinterpret_cast<char*>(acts + actions.size());
+
+    auto copy = [&str](const std::string& from) {
+        char* to = str;
+        memcpy(to, from.c_str(), from.size() + 1);
+        str += from.size() + 1;
+        return to;
+    };
+
+    mPath = copy(path);
+    if (!cgroup.empty())
+        mCgroup = copy(cgroup);
+
+    argv[0] = copy(proc.path());
+    for (size_t i = 0; i < args.size(); ++i)
+        argv[i + 1] = copy(args[i]);
+    argv[argvCount - 1] = 0;
+    mArgv = argv;
+
+    static char* const noEnviron[] = { 0 };
+    if (assigns.empty()) {
+        mEnvp = mEnviron ? mEnviron->envp() : noEnviron;
+    } else {
+        if (mEnviron)
+            memcpy(envp, mEnviron->envp(), environSize * sizeof(char*));
+        size_t count = environSize;
+        for (const auto& assign : assigns) {
+            char* var = str;
+            memcpy(str, assign.first.c_str(), assign.first.size());
+            str += assign.first.size();
+            *str++ = '=';
+            memcpy(str, assign.second.c_str(), assign.second.size() + 1);
+            str += assign.second.size() + 1;
+
+            const ssize_t idx = mEnviron ? mEnviron->indexOf(assign.first) : -1;
+            if (idx != -1)
+                envp[idx] = var;
+            else
+                envp[count++] = var;
+        }
+        envp[count] = 0;
+        mEnvp = envp;
+    }
+
+    memcpy(acts, actions.data(), actions.size() * sizeof(FdAction));
+    mActions = acts;
+    mActionCount = actions.size();
+}
+
+pid_t Spawn::start()
+{
+    if (mError)
+        return -1;
+
+    pid_t pid;
+    if (!Zygote::spawn(*this, pid))
+        pid = clone(0);
+    if (pid == -1)
+        return -1;
+    if (mError) {
+        // the child is already on its way out
+        int status, e;
+        EINTRWRAP(e, waitpid(pid, &status, 0));
+        return -1;
+    }
+    return pid;
+}
+
+pid_t Spawn::clone(int flags)
+{
+    // the child runs on this until it execs, we're suspended meanwhile
+    enum { StackSize = 32768 };
+    alignas(16) char stack[StackSize];
+
+    // no signal handler of ours may run in the child while it's
+    // sharing our memory, it puts the old mask back itself
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &mMask);
+
+    const pid_t pid = ::clone(child, stack + StackSize, CLONE_VM | CLONE_VFORK | SIGCHLD | flags, this);
+    const int cloneError = errno;
+
+    pthread_sigmask(SIG_SETMASK, &mMask, 0);
+
+    if (pid == -1) {
+        mError = cloneError;
+        mFailure = Setup;
+    }
+    return pid;
+}
+
+std::string Spawn::errorString() const
+{
+    char buf[256];
+    const char* err = strerror_r(mError, buf, sizeof(buf));
+    switch (mFailure) {
+    case NoFailure:
+        break;
+    case NotFound:
+        return mCommand + ": command not found";
+    case Redirect:
+        return mFailedFile + ": " + err;
+    case Exec:
+        return std::string(mPath) + ": " + err;
+    case Setup: {
+        static const char* steps[] = { 0, "cd", "cgroup", "affinity", "nice", "ioprio", "rlimit" };
+        if (mStep != NoStep)
+            return mCommand + ": " + steps[mStep] + ": " + err;
+        return mCommand + ": " + err; }
+    }
+    return std::string();
+}
+
+// careful, this runs in our memory on a borrowed stack. system calls only,
+// no allocations, no locks and nothing that writes to anything but the error
+int Spawn::child(void* arg)
+{
+    Spawn* spawn = static_cast<Spawn*>(arg);
+    const Options& opts = spawn->mOpts;
+    int e;
+
+    auto fail = [spawn](Failure failure, Step step = NoStep) {
+        spawn->mError = errno ? errno : EINVAL;
+        spawn->mFailure = failure;
+        spawn->mStep = step;
+        _exit(127);
+    };
+
+    if (opts.pgid != -1) {
+        const pid_t pgid = opts.pgid ? opts.pgid : getpid();
+        setpgid(0, pgid);
+        // SIGTTOU is still blocked so this works from the background too
+        if (opts.foreground)
+            tcsetpgrp(STDIN_FILENO, pgid);
+    }
+
+    // the exec would reset handlers anyway but not ignored signals,
+    // and a handler must not run before we get that far
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    for (int sig = 1; sig < NSIG; ++sig) {
+        if (sig != SIGKILL && sig != SIGSTOP)
+            sigaction(sig, &sa, 0);
+    }
+    sigprocmask(SIG_SETMASK, &spawn->mMask, 0);
+
+    if (spawn->mCwd && chdir(spawn->mCwd) == -1)
+        fail(Setup, Directory);
+
+    // cgroup first so that everything after is accounted there.
+    // writing 0 moves whoever writes it
+    if (spawn->mCgroup) {
+        int fd;
+        EINTRWRAP(fd, ::open(spawn->mCgroup, O_WRONLY | O_CLOEXEC));
+        if (fd == -1)
+            fail(Setup, Cgroup);
+        EINTRWRAP(e, ::write(fd, "0", 1));
+        if (e == -1)
+            fail(Setup, Cgroup);
+        EINTRWRAP(e, ::close(fd));
+    }
+    const Attributes& attrs = spawn->mAttributes;
+    if (attrs.affinity && sched_setaffinity(0, sizeof(attrs.cpus), &attrs.cpus) == -1)
+        fail(Setup, Affinity);
+    if (attrs.nice && setpriority(PRIO_PROCESS, 0, attrs.niceValue) == -1)
+        fail(Setup, Nice);
+    if (attrs.ioprio != -1 && syscall(SYS_ioprio_set, IoprioWhoProcess, 0, attrs.ioprio) == -1)
+        fail(Setup, IoPriority);
+    if (attrs.umask != -1)
+        umask(attrs.umask);
+    for (uint32_t i = 0; i < attrs.limitCount; ++i) {
+        if (setrlimit(attrs.limits[i].resource, &attrs.limits[i].limit) == -1)
+            fail(Setup, Limit);
+    }
+
+    for (size_t i = 0; i < spawn->mActionCount; ++i) {
+        const FdAction& action = spawn->mActions[i];
+        switch (action.type) {
+        case FdAction::Dup:
+            EINTRWRAP(e, dup2(action.fd, action.target));
+            if (e == -1)
+                fail(Setup);
+            break;
+        case FdAction::Close:
+            EINTRWRAP(e, ::close(action.fd));
+            break;
+        case FdAction::Inherit:
+            fcntl(action.fd, F_SETFD, 0);
+            break;
+        }
+    }
+
+    execve(spawn->mPath, spawn->mArgv, spawn->mEnvp);
+    fail(Exec);
+    return 127;
+}
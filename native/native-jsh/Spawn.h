@@ -0,0 +1,114 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include "Process.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sched.h>
+
+// starts a process with clone(CLONE_VM|CLONE_VFORK) instead of fork().
+// the child borrows our address space until it has called execve(), so
+// nothing is copied no matter how large the node heap is. the process is
+// compiled into an exec plan up front: argv, envp, the resolved path and
+// what to do with which fd, all in one block. redirect files and
+// here-documents are opened here as well, the child only does dup2(),
+// close() and execve(), and applies the scheduling and resource
+// attributes it was given
+class Spawn
+{
+public:
+    struct Options
+    {
+        int in, out, err;
+        // process group to put the child in, 0 for a new group led by
+        // the child and -1 to leave it in ours
+        pid_t pgid;
+        // hand the terminal to the child's process group
+        bool foreground;
+    };
+
+    Spawn(const Process& proc, const Options& opts);
+    ~Spawn();
+
+    // returns the pid of the child once it has exec'ed. if it didn't get
+    // that far -1 is returned, the child has been reaped and error() says why.
+    // the zygote starts it for us if there is one
+    pid_t start();
+    int error() const { return mError; }
+    // what went wrong, for the user
+    std::string errorString() const;
+
+private:
+    Spawn(const Spawn&) = delete;
+    Spawn& operator=(const Spawn&) = delete;
+
+    // the zygote builds its plans from what we send it
+    Spawn();
+
+    void compile(const Process& proc);
+    // a sealed memfd holding data, positioned at the start
+    static int document(const std::string& data);
+    // the pid, even if the child failed. flags go on top of CLONE_VM|CLONE_VFORK
+    pid_t clone(int flags);
+    static int child(void* arg);
+
+    struct FdAction
+    {
+        // Dup is dup2(fd, target), Inherit clears close-on-exec on fd
+        enum Type { Dup, Close, Inherit } type;
+        int fd, target;
+    };
+    // what else the child does to itself, from the process' attributes
+    struct Attributes
+    {
+        bool affinity, nice;
+        // -1 keeps the umask we have, which is the shell's
+        int niceValue, ioprio, umask;
+        cpu_set_t cpus;
+        uint32_t limitCount;
+        struct
+        {
+            int resource;
+            struct rlimit limit;
+        } limits[RLIM_NLIMITS];
+    };
+    enum Failure { NoFailure, NotFound, Redirect, Setup, Exec };
+    // where a Setup failure happened
+    enum Step { NoStep, Directory, Cgroup, Affinity, Nice, IoPriority, Limit };
+
+    Options mOpts;
+    std::string mCommand;
+    // shared envp, used as is when the process has no variables of its own
+    std::shared_ptr<const Environment::Snapshot> mEnviron;
+
+    // the plan, these all point into mArena. the directory to change to
+    // is only set in the zygote, we're already where we should be
+    std::unique_ptr<char[]> mArena;
+    const char* mCwd;
+    const char* mPath;
+    char* const* mArgv;
+    char* const* mEnvp;
+    const FdAction* mActions;
+    size_t mActionCount;
+    Attributes mAttributes;
+    // the cgroup.procs file to write ourselves to
+    const char* mCgroup;
+
+    // redirect files, ours to close once the child has them
+    std::vector<int> mFiles;
+    std::string mFailedFile;
+
+    sigset_t mMask;
+    // written by the child, we share memory with it
+    volatile int mError;
+    volatile Failure mFailure;
+    volatile Step mStep;
+
+    friend class Zygote;
+};
+
+#endif
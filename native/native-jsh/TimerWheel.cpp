@@ -0,0 +1,191 @@
+#include "TimerWheel.h"
+#include <uv.h>
+#include <list>
+#include <unordered_map>
+
+enum {
+    Bits = 6,
+    Slots = 1 << Bits,
+    Mask = Slots - 1,
+    Levels = 4
+};
+
+namespace {
+
+struct Entry
+{
+    TimerWheel::Id id;
+    // the tick it fires at
+    uint64_t expires;
+    std::function<void()> func;
+};
+
+typedef std::list<Entry> Slot;
+
+}
+
+struct {
+    bool initialized;
+    uv_timer_t timer;
+    // milliseconds at init, ticks count from there
+    uint64_t start;
+    // every tick up to this one has been handled
+    uint64_t current;
+    TimerWheel::Id nextId;
+    Slot slots[Levels][Slots];
+    std::unordered_map<TimerWheel::Id, std::pair<Slot*, Slot::iterator> > index;
+} static state;
+
+// not uv_now(), the loop's cached time can be behind by however long
+// the current iteration has been running and timers would fire early
+static uint64_t milliseconds()
+{
+    return uv_hrtime() / 1000000;
+}
+
+static uint64_t now()
+{
+    return milliseconds() - state.start;
+}
+
+static void insert(Entry&& entry)
+{
+    const uint64_t delta = entry.expires > state.current ? entry.expires - state.current : 0;
+    int level = 0;
+    while (level < Levels - 1 && delta >= (1ull << (Bits * (level + 1))))
+        ++level;
+    size_t slot;
+    if (delta >= (1ull << (Bits * (level + 1)))) {
+        // further out than the wheel reaches, it's put in the last slot
+        // of the top level and placed again when that comes around
+        slot = ((state.current >> (Bits * level)) + Mask) & Mask;
+    } else {
+        slot = (entry.expires >> (Bits * level)) & Mask;
+    }
+    Slot& list = state.slots[level][slot];
+    const TimerWheel::Id id = entry.id;
+    list.push_back(std::move(entry));
+    state.index[id] = std::make_pair(&list, std::prev(list.end()));
+}
+
+// the next tick that has anything to do, 0 if there is none. a level
+// above the first has something to do when the first tick of a
+// non-empty slot comes around and its timers move down
+static uint64_t nextTick()
+{
+    uint64_t next = 0;
+    for (int level = 0; level < Levels; ++level) {
+        const uint64_t base = state.current >> (Bits * level);
+        for (uint64_t k = 1; k <= Slots; ++k) {
+            if (!state.slots[level][(base + k) & Mask].empty()) {
+                const uint64_t tick = (base + k) << (Bits * level);
+                if (!next || tick < next)
+                    next = tick;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+static void process(uint64_t tick)
+{
+    // higher levels first, what they hand down may land
+    // in a slot of a lower level that is due now as well
+    for (int level = Levels - 1; level > 0; --level) {
+        if (tick & ((1ull << (Bits * level)) - 1))
+            continue;
+        Slot cascade;
+        cascade.swap(state.slots[level][(tick >> (Bits * level)) & Mask]);
+        for (auto& entry : cascade)
+            insert(std::move(entry));
+    }
+
+    Slot due;
+    Slot& slot = state.slots[0][tick & Mask];
+    for (auto it = slot.begin(); it != slot.end();) {
+        auto cur = it++;
+        if (cur->expires <= tick) {
+            state.index.erase(cur->id);
+            due.splice(due.end(), slot, cur);
+        }
+    }
+    // the callbacks may add and remove timers as they please
+    for (auto& entry : due)
+        entry.func();
+}
+
+static void schedule()
+{
+    const uint64_t next = nextTick();
+    if (!next) {
+        uv_timer_stop(&state.timer);
+        return;
+    }
+    const uint64_t n = now();
+    uv_timer_start(&state.timer, [](uv_timer_t*) {
+            const uint64_t target = now();
+            for (;;) {
+                const uint64_t next = nextTick();
+                if (!next || next > target) {
+                    state.current = target;
+                    break;
+                }
+                state.current = next;
+                process(next);
+            }
+            schedule();
+        }, next > n ? next - n : 0, 0);
+}
+
+void TimerWheel::init()
+{
+    if (state.initialized)
+        return;
+    uv_timer_init(uv_default_loop(), &state.timer);
+    state.start = milliseconds();
+    state.current = 0;
+    state.nextId = InvalidId + 1;
+    state.initialized = true;
+}
+
+void TimerWheel::deinit()
+{
+    if (!state.initialized)
+        return;
+    uv_timer_stop(&state.timer);
+    for (auto& level : state.slots) {
+        for (auto& slot : level)
+            slot.clear();
+    }
+    state.index.clear();
+}
+
+TimerWheel::Id TimerWheel::add(uint64_t ms, std::function<void()>&& func)
+{
+    const uint64_t n = now();
+    if (state.index.empty())
+        state.current = n;
+    const Id id = state.nextId++;
+    // the current tick has been handled already
+    insert({ id, (n > state.current ? n : state.current) + (ms ? ms : 1), std::forward<std::function<void()> >(func) });
+    schedule();
+    return id;
+}
+
+bool TimerWheel::remove(Id id)
+{
+    auto it = state.index.find(id);
+    if (it == state.index.end())
+        return false;
+    it->second.first->erase(it->second.second);
+    state.index.erase(it);
+    if (state.index.empty())
+        uv_timer_stop(&state.timer);
+    return true;
+}
+
+size_t TimerWheel::size()
+{
+    return state.index.size();
+}
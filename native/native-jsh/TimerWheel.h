@@ -0,0 +1,33 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// timers for the loop thread that cost the same no matter how many of
+// them there are. a hierarchical wheel with a millisecond tick: the
+// first level has a slot for each of the next 64 ticks, every level
+// above has slots 64 times as wide, and a timer moves down a level
+// whenever the one below it comes around to its slot. adding and
+// removing is constant time and the loop is only woken up for slots
+// that have something in them. only to be used from the loop thread
+class TimerWheel
+{
+public:
+    typedef uint64_t Id;
+    enum { InvalidId = 0 };
+
+    static void init();
+    static void deinit();
+
+    // calls func once, ms milliseconds from now
+    static Id add(uint64_t ms, std::function<void()>&& func);
+    // false if id has fired or was removed already
+    static bool remove(Id id);
+
+    // how many timers are waiting to fire
+    static size_t size();
+};
+
+#endif
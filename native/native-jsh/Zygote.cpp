@@ -0,0 +1,546 @@
+#include "Zygote.h"
+#include "Spawn.h"
+#include "utils.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sched.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+namespace {
+
+// every request is a header with the fds attached, then the body: the
+// request, the spawn's attributes, the fd actions and then the strings,
+// each one null terminated.
+// the cwd comes first, then the cgroup file, the path, argv and envp. an action's fd is
+// the index of one of the fds we sent, or -1 - fd for one of the child's
+// own that an earlier action has set up, as in 2>&1
+struct Header
+{
+    uint32_t size;
+    uint32_t fds;
+};
+
+struct Request
+{
+    int32_t pgid;
+    int32_t foreground;
+    uint32_t argc, envc, actions;
+};
+
+struct Reply
+{
+    int32_t pid;
+    int32_t error;
+    int32_t failure;
+    int32_t step;
+};
+
+}
+
+enum {
+    // SCM_MAX_FD, the most fds one message can carry
+    MaxFds = 253,
+    // the zygote moves the fds it gets up here, like other shells
+    // do with their own, out of the way of the child's redirects
+    FirstFd = 10
+};
+
+struct {
+    Mutex mutex;
+    bool running;
+    int fd;
+    pid_t pid;
+    // what the zygote inherited when it was forked, children started
+    // by it get the shell's current ones wherever these are different
+    int umask;
+    struct rlimit limits[RLIM_NLIMITS];
+} static state;
+
+// there's no way to read the umask without setting it, and setting it
+// for a moment would race with every thread that creates files
+static int currentUmask()
+{
+    int fd, e;
+    EINTRWRAP(fd, ::open("/proc/self/status", O_RDONLY | O_CLOEXEC));
+    if (fd == -1)
+        return -1;
+    char buf[4096];
+    ssize_t r;
+    EINTRWRAP(r, ::read(fd, buf, sizeof(buf) - 1));
+    EINTRWRAP(e, ::close(fd));
+    if (r <= 0)
+        return -1;
+    buf[r] = '\0';
+    const char* line = strstr(buf, "\nUmask:");
+    if (!line)
+        return -1;
+    return static_cast<int>(strtol(line + 7, 0, 8));
+}
+
+// fills in the umask and the limits of the shell that differ from the
+// zygote's, limits the process sets itself stay as they are. they're
+// our own, a local start with them does the same. false if the umask
+// can't be known, the child has to be started locally then
+bool Zygote::inherit(Spawn& spawn)
+{
+    Spawn::Attributes& attrs = spawn.mAttributes;
+    const int mask = currentUmask();
+    if (mask == -1 || state.umask == -1)
+        return false;
+    if (mask != state.umask)
+        attrs.umask = mask;
+    for (int resource = 0; resource < RLIM_NLIMITS; ++resource) {
+        struct rlimit limit;
+        if (getrlimit(resource, &limit) == -1)
+            continue;
+        const struct rlimit& forked = state.limits[resource];
+        if (limit.rlim_cur == forked.rlim_cur && limit.rlim_max == forked.rlim_max)
+            continue;
+        bool own = false;
+        for (uint32_t i = 0; i < attrs.limitCount && !own; ++i)
+            own = attrs.limits[i].resource == resource;
+        if (own || attrs.limitCount == RLIM_NLIMITS)
+            continue;
+        auto& l = attrs.limits[attrs.limitCount++];
+        l.resource = resource;
+        l.limit = limit;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* data, size_t size)
+{
+    char* cur = static_cast<char*>(data);
+    while (size) {
+        ssize_t r;
+        EINTRWRAP(r, ::read(fd, cur, size));
+        if (r <= 0)
+            return false;
+        cur += r;
+        size -= r;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* cur = static_cast<const char*>(data);
+    while (size) {
+        ssize_t w;
+        EINTRWRAP(w, ::send(fd, cur, size, MSG_NOSIGNAL));
+        if (w <= 0)
+            return false;
+        cur += w;
+        size -= w;
+    }
+    return true;
+}
+
+// the fds go with the first byte, the rest is written as usual
+static bool sendRequest(int fd, const std::vector<char>& msg, const std::vector<int>& fds)
+{
+    std::vector<char> control(CMSG_SPACE(fds.size() * sizeof(int)));
+    iovec iov = { const_cast<char*>(msg.data()), msg.size() };
+    msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (!fds.empty()) {
+        mh.msg_control = control.data();
+        mh.msg_controllen = control.size();
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+    ssize_t w;
+    EINTRWRAP(w, sendmsg(fd, &mh, MSG_NOSIGNAL));
+    if (w <= 0)
+        return false;
+    return writeAll(fd, msg.data() + w, msg.size() - w);
+}
+
+static bool receiveRequest(int fd, Header& header, std::vector<int>& fds)
+{
+    alignas(cmsghdr) char control[CMSG_SPACE(MaxFds * sizeof(int))];
+    iovec iov = { &header, sizeof(header) };
+    msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    ssize_t r;
+    EINTRWRAP(r, recvmsg(fd, &mh, MSG_CMSG_CLOEXEC));
+    if (r <= 0)
+        return false;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+        fds.insert(fds.end(), data, data + count);
+    }
+    return readAll(fd, reinterpret_cast<char*>(&header) + r, sizeof(header) - r);
+}
+
+// runs in the zygote, turns a request back into a plan like the one
+// Spawn::compile() made, with the fd actions pointing at our copies.
+// copies that sit where the child dups something to are moved
+bool Zygote::build(Spawn& spawn, const std::vector<char>& body, std::vector<int>& fds)
+{
+    const size_t head = sizeof(Request) + sizeof(Spawn::Attributes);
+    if (body.size() < head)
+        return false;
+    Request req;
+    memcpy(&req, body.data(), sizeof(req));
+    memcpy(&spawn.mAttributes, body.data() + sizeof(Request), sizeof(Spawn::Attributes));
+    if (spawn.mAttributes.limitCount > RLIM_NLIMITS)
+        return false;
+    const size_t actionBytes = req.actions * sizeof(Spawn::FdAction);
+    if (body.size() < head + actionBytes)
+        return false;
+    const char* strings = body.data() + head + actionBytes;
+    const size_t strBytes = body.data() + body.size() - strings;
+    if (!strBytes || strings[strBytes - 1])
+        return false;
+
+    const size_t ptrCount = req.argc + 1 + req.envc + 1;
+    spawn.mArena.reset(new char[ptrCount * sizeof(char*) + actionBytes + strBytes]);
+    char** argv = reinterpret_cast<char**>(spawn.mArena.get());
+    char** envp = argv + req.argc + 1;
+    Spawn::FdAction* acts = reinterpret_cast<Spawn::FdAction*>(envp + req.envc + 1);
+    char* str = reinterpret_cast<char*>(acts) + actionBytes;
+    memcpy(acts, body.data() + head, actionBytes);
+    memcpy(str, strings, strBytes);
+
+    // a copy has to outlive every dup2() before the one that uses it
+    int highest = -1;
+    for (uint32_t i = 0; i < req.actions; ++i)
+        highest = std::max(highest, acts[i].target);
+    for (auto& fd : fds) {
+        if (fd > highest)
+            continue;
+        const int moved = fcntl(fd, F_DUPFD_CLOEXEC, highest + 1);
+        if (moved == -1)
+            return false;
+        int e;
+        EINTRWRAP(e, ::close(fd));
+        fd = moved;
+    }
+
+    for (uint32_t i = 0; i < req.actions; ++i) {
+        if (acts[i].fd < 0) {
+            acts[i].fd = -1 - acts[i].fd;
+            continue;
+        }
+        if (static_cast<size_t>(acts[i].fd) >= fds.size())
+            return false;
+        acts[i].fd = fds[acts[i].fd];
+    }
+
+    const char* end = str + strBytes;
+    auto next = [&str, end]() -> char* {
+        if (str == end)
+            return 0;
+        char* cur = str;
+        str += strlen(str) + 1;
+        return cur;
+    };
+    const char* cwd = next();
+    const char* cgroup = next();
+    spawn.mPath = next();
+    for (uint32_t i = 0; i < req.argc; ++i)
+        argv[i] = next();
+    argv[req.argc] = 0;
+    for (uint32_t i = 0; i < req.envc; ++i)
+        envp[i] = next();
+    envp[req.envc] = 0;
+    if (!spawn.mPath || (req.argc && !argv[req.argc - 1]) || (req.envc && !envp[req.envc - 1]))
+        return false;
+
+    spawn.mCwd = (cwd && *cwd) ? cwd : 0;
+    spawn.mCgroup = (cgroup && *cgroup) ? cgroup : 0;
+    spawn.mArgv = argv;
+    spawn.mEnvp = envp;
+    spawn.mActions = acts;
+    spawn.mActionCount = req.actions;
+    spawn.mOpts.pgid = req.pgid;
+    spawn.mOpts.foreground = req.foreground != 0;
+    return true;
+}
+
+void Zygote::serve(int sock)
+{
+    int e;
+    for (;;) {
+        Header header;
+        std::vector<int> fds;
+        if (!receiveRequest(sock, header, fds))
+            break;
+        std::vector<char> body(header.size);
+        if (!readAll(sock, body.data(), body.size()))
+            break;
+        for (auto& fd : fds) {
+            const int moved = fcntl(fd, F_DUPFD_CLOEXEC, static_cast<int>(FirstFd));
+            if (moved != -1) {
+                EINTRWRAP(e, ::close(fd));
+                fd = moved;
+            }
+        }
+
+        Reply reply = { -1, EINVAL, Spawn::Setup, Spawn::NoStep };
+        {
+            Spawn spawn;
+            if (fds.size() == header.fds && build(spawn, body, fds)) {
+                reply.pid = spawn.clone(CLONE_PARENT);
+                reply.error = spawn.mError;
+                reply.failure = spawn.mFailure;
+                reply.step = spawn.mStep;
+            }
+        }
+        for (int fd : fds) {
+            EINTRWRAP(e, ::close(fd));
+        }
+        if (!writeAll(sock, &reply, sizeof(reply)))
+            break;
+    }
+}
+
+// everything but stdio and the socket, we mustn't keep
+// the other ends of the shell's pipes open
+static void closeFrom(int lowest)
+{
+    std::vector<int> fds;
+    if (DIR* dir = opendir("/proc/self/fd")) {
+        const int self = dirfd(dir);
+        while (dirent* ent = readdir(dir)) {
+            const int fd = atoi(ent->d_name);
+            if (fd >= lowest && fd != self)
+                fds.push_back(fd);
+        }
+        closedir(dir);
+    } else {
+        const long max = sysconf(_SC_OPEN_MAX);
+        for (long fd = lowest; fd < max; ++fd)
+            fds.push_back(fd);
+    }
+    int e;
+    for (int fd : fds) {
+        EINTRWRAP(e, ::close(fd));
+    }
+}
+
+bool Zygote::start()
+{
+    MutexLocker locker(&state.mutex);
+    if (state.running)
+        return true;
+
+    int sv[2], e;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+        return false;
+
+    state.umask = currentUmask();
+    for (int resource = 0; resource < RLIM_NLIMITS; ++resource) {
+        if (getrlimit(resource, &state.limits[resource]) == -1)
+            state.limits[resource].rlim_cur = state.limits[resource].rlim_max = RLIM_INFINITY;
+    }
+
+    const pid_t pid = fork();
+    if (pid == -1) {
+        EINTRWRAP(e, ::close(sv[0]));
+        EINTRWRAP(e, ::close(sv[1]));
+        return false;
+    }
+    if (!pid) {
+        // we're a copy of a threaded process, only ever use our own code
+        // and the socket from here on. job control signals are for the
+        // shell's jobs, not for us. the socket closing means we're done
+        EINTRWRAP(e, dup2(sv[1], STDERR_FILENO + 1));
+        fcntl(STDERR_FILENO + 1, F_SETFD, FD_CLOEXEC);
+        closeFrom(STDERR_FILENO + 2);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        for (int sig = 1; sig < NSIG; ++sig) {
+            if (sig == SIGKILL || sig == SIGSTOP)
+                continue;
+            switch (sig) {
+            case SIGINT:
+            case SIGQUIT:
+            case SIGTSTP:
+            case SIGTTIN:
+            case SIGTTOU:
+            case SIGPIPE:
+                sa.sa_handler = SIG_IGN;
+                break;
+            default:
+                sa.sa_handler = SIG_DFL;
+                break;
+            }
+            sigaction(sig, &sa, 0);
+        }
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, 0);
+
+        serve(STDERR_FILENO + 1);
+        _exit(0);
+    }
+
+    EINTRWRAP(e, ::close(sv[1]));
+    state.fd = sv[0];
+    state.pid = pid;
+    state.running = true;
+    return true;
+}
+
+// with the mutex held
+static void shutdown()
+{
+    if (!state.running)
+        return;
+    int e, status;
+    EINTRWRAP(e, ::close(state.fd));
+    EINTRWRAP(e, waitpid(state.pid, &status, 0));
+    state.running = false;
+    state.fd = -1;
+    state.pid = 0;
+}
+
+void Zygote::stop()
+{
+    MutexLocker locker(&state.mutex);
+    shutdown();
+}
+
+bool Zygote::isRunning()
+{
+    MutexLocker locker(&state.mutex);
+    return state.running;
+}
+
+bool Zygote::exited(pid_t pid)
+{
+    MutexLocker locker(&state.mutex);
+    if (!state.running || pid != state.pid)
+        return false;
+    shutdown();
+    return true;
+}
+
+bool Zygote::spawn(Spawn& spawn, pid_t& pid)
+{
+    MutexLocker locker(&state.mutex);
+    if (!state.running)
+        return false;
+
+    // the zygote gets its own copies of the fds that the child needs. it
+    // has nothing to close, the copies are close-on-exec there, and what
+    // we would inherit it has to dup2() from the copy instead
+    std::vector<int> fds;
+    auto index = [&fds](int fd) {
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i] == fd)
+                return static_cast<int>(i);
+        }
+        fds.push_back(fd);
+        return static_cast<int>(fds.size() - 1);
+    };
+    std::vector<int> childFds;
+    auto source = [&](int fd) {
+        for (int child : childFds) {
+            if (child == fd)
+                return -1 - fd;
+        }
+        return index(fd);
+    };
+    std::vector<Spawn::FdAction> actions;
+    for (size_t i = 0; i < spawn.mActionCount; ++i) {
+        const Spawn::FdAction& action = spawn.mActions[i];
+        switch (action.type) {
+        case Spawn::FdAction::Dup:
+            actions.push_back({ Spawn::FdAction::Dup, source(action.fd), action.target });
+            childFds.push_back(action.target);
+            break;
+        case Spawn::FdAction::Close:
+            break;
+        case Spawn::FdAction::Inherit:
+            actions.push_back({ Spawn::FdAction::Dup, source(action.fd), action.fd });
+            childFds.push_back(action.fd);
+            break;
+        }
+    }
+    if (fds.size() > MaxFds)
+        return false;
+
+    // the zygote is still where we were when it was started
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return false;
+    // and so are its umask and limits
+    if (!inherit(spawn))
+        return false;
+
+    Request req;
+    req.pgid = spawn.mOpts.pgid;
+    req.foreground = spawn.mOpts.foreground;
+    req.argc = 0;
+    req.envc = 0;
+    req.actions = actions.size();
+    const char* cgroup = spawn.mCgroup ? spawn.mCgroup : "";
+    size_t strBytes = strlen(cwd) + 1 + strlen(cgroup) + 1 + strlen(spawn.mPath) + 1;
+    for (char* const* arg = spawn.mArgv; *arg; ++arg, ++req.argc)
+        strBytes += strlen(*arg) + 1;
+    for (char* const* var = spawn.mEnvp; *var; ++var, ++req.envc)
+        strBytes += strlen(*var) + 1;
+
+    Header header;
+    header.size = sizeof(Request) + sizeof(Spawn::Attributes) + actions.size() * sizeof(Spawn::FdAction) + strBytes;
+    header.fds = fds.size();
+
+    std::vector<char> msg(sizeof(Header) + header.size);
+    char* cur = msg.data();
+    auto append = [&cur](const void* data, size_t size) {
+        memcpy(cur, data, size);
+        cur += size;
+    };
+    append(&header, sizeof(header));
+    append(&req, sizeof(req));
+    append(&spawn.mAttributes, sizeof(Spawn::Attributes));
+    append(actions.data(), actions.size() * sizeof(Spawn::FdAction));
+    append(cwd, strlen(cwd) + 1);
+    append(cgroup, strlen(cgroup) + 1);
+    append(spawn.mPath, strlen(spawn.mPath) + 1);
+    for (char* const* arg = spawn.mArgv; *arg; ++arg)
+        append(*arg, strlen(*arg) + 1);
+    for (char* const* var = spawn.mEnvp; *var; ++var)
+        append(*var, strlen(*var) + 1);
+
+    Reply reply;
+    if (!sendRequest(state.fd, msg, fds) || !readAll(state.fd, &reply, sizeof(reply))) {
+        // it's gone, we'll start things ourselves from now on
+        shutdown();
+        return false;
+    }
+
+    pid = reply.pid;
+    if (reply.error) {
+        spawn.mError = reply.error;
+        spawn.mFailure = static_cast<Spawn::Failure>(reply.failure);
+        spawn.mStep = static_cast<Spawn::Step>(reply.step);
+    }
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <vector>
+#include <sys/types.h>
+
+class Spawn;
+
+// a small helper process forked at init, while the shell is still small,
+// that starts processes for us. a Spawn's exec plan and the fds it needs
+// are sent to it over a socket, it clones with CLONE_PARENT so that the
+// processes are still our children and reaped by us like any other. the
+// cost of starting a process then doesn't grow with the node heap or the
+// number of fds we have open
+class Zygote
+{
+public:
+    static bool start();
+    static void stop();
+    static bool isRunning();
+    // the job waiter found pid exited, true if that was the zygote.
+    // it's reaped and we start things ourselves from then on
+    static bool exited(pid_t pid);
+
+    // has the zygote start spawn, false if there is no zygote or it couldn't
+    // take the request, the caller starts it itself then. otherwise pid and
+    // spawn's error are set like Spawn::clone() would have
+    static bool spawn(Spawn& spawn, pid_t& pid);
+
+private:
+    // the zygote's side of it
+    static void serve(int sock);
+    static bool build(Spawn& spawn, const std::vector<char>& body, std::vector<int>& fds);
+    // adds the umask and limits the zygote doesn't share with us
+    static bool inherit(Spawn& spawn);
+};
+
+#endif
@@ -5,7 +5,7 @@
 	"<!(node -e \"require('nan')\")"
       ],
       "target_name": "native-jsh",
-      "sources": [ "jsh.cpp", "utils.cpp", "SignalBase.cpp", "Job.cpp" ],
+      "sources": [ "jsh.cpp", "utils.cpp", "SignalBase.cpp", "Buffer.cpp", "CommandHash.cpp", "Environment.cpp", "Builtin.cpp", "Spawn.cpp", "Zygote.cpp", "TimerWheel.cpp", "Job.cpp" ],
       "cflags_cc": [ "-std=c++14" ],
       "xcode_settings": {
 	"OTHER_CPLUSPLUSFLAGS": [
@@ -3,8 +3,18 @@
 #include <signal.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <limits.h>
+#include <deque>
+#include <memory>
+#include <limits>
 #include "Job.h"
 #include "Process.h"
+#include "CommandHash.h"
+#include "Builtin.h"
+#include "Zygote.h"
+#include "Environment.h"
 #include "SignalBase.h"
 
 using std::bind;
@@ -21,6 +31,27 @@ struct {
 NAN_METHOD(init) {
     // check state, wait for foreground if needed and return an object telling JS about our state
 
+    size_t readers = Job::DefaultReaders;
+    bool zygote = false, pidfds = true;
+    if (info.Length() > 0 && info[0]->IsObject()) {
+        auto opts = v8::Local<v8::Object>::Cast(info[0]);
+        auto maybeReaders = Nan::Get(opts, Nan::New("readers").ToLocalChecked());
+        if (!maybeReaders.IsEmpty() && !maybeReaders.ToLocalChecked()->IsUndefined()) {
+            auto value = maybeReaders.ToLocalChecked();
+            if (!value->IsUint32() || !v8::Local<v8::Uint32>::Cast(value)->Value()) {
+                Nan::ThrowError("init readers needs to be a positive number");
+                return;
+            }
+            readers = v8::Local<v8::Uint32>::Cast(value)->Value();
+        }
+        auto maybeZygote = Nan::Get(opts, Nan::New("zygote").ToLocalChecked());
+        if (!maybeZygote.IsEmpty())
+            zygote = Nan::To<bool>(maybeZygote.ToLocalChecked()).FromJust();
+        auto maybePidfds = Nan::Get(opts, Nan::New("pidfds").ToLocalChecked());
+        if (!maybePidfds.IsEmpty() && !maybePidfds.ToLocalChecked()->IsUndefined())
+            pidfds = Nan::To<bool>(maybePidfds.ToLocalChecked()).FromJust();
+    }
+
     state.pid = getpid();
     state.is_interactive = isatty(STDIN_FILENO) != 0;
     if (state.is_interactive) {
@@ -51,19 +82,27 @@ NAN_METHOD(init) {
         state.pgid = getpgrp();
     }
 
+    // before we start any threads of our own. if it can't be
+    // started we'll start our processes ourselves
+    if (zygote)
+        Zygote::start();
+
     SignalBase::init();
-    Job::init();
+    Job::init(readers, pidfds);
 
     auto obj = Nan::New<v8::Object>();
     Nan::Set(obj, Nan::New<v8::String>("pid").ToLocalChecked(), Nan::New<v8::Int32>(state.pid));
     Nan::Set(obj, Nan::New<v8::String>("pgid").ToLocalChecked(), Nan::New<v8::Int32>(state.pgid));
     Nan::Set(obj, Nan::New<v8::String>("interactive").ToLocalChecked(), Nan::New<v8::Boolean>(state.is_interactive));
+    Nan::Set(obj, Nan::New<v8::String>("zygote").ToLocalChecked(), Nan::New<v8::Boolean>(Zygote::isRunning()));
+    Nan::Set(obj, Nan::New<v8::String>("pidfds").ToLocalChecked(), Nan::New<v8::Boolean>(Job::hasPidfds()));
 
     info.GetReturnValue().Set(obj);
 }
 
 NAN_METHOD(deinit) {
     Job::deinit();
+    Zygote::stop();
 }
 
 NAN_METHOD(restore) {
@@ -127,8 +166,364 @@ NAN_METHOD(users) {
     info.GetReturnValue().Set(ret);
 }
 
+NAN_METHOD(bufferStats) {
+    const auto stats = Slab::stats();
+
+    auto obj = Nan::New<v8::Object>();
+    Nan::Set(obj, Nan::New("slabSize").ToLocalChecked(), Nan::New<v8::Number>(Slab::Size));
+    Nan::Set(obj, Nan::New("allocated").ToLocalChecked(), Nan::New<v8::Number>(stats.allocated));
+    Nan::Set(obj, Nan::New("freed").ToLocalChecked(), Nan::New<v8::Number>(stats.freed));
+    Nan::Set(obj, Nan::New("reused").ToLocalChecked(), Nan::New<v8::Number>(stats.reused));
+    Nan::Set(obj, Nan::New("pooled").ToLocalChecked(), Nan::New<v8::Number>(stats.pooled));
+
+    info.GetReturnValue().Set(obj);
+}
+
+// everything the native side is up to, for debugging hangs and leaks
+// without having to attach a debugger. the counters are only roughly
+// consistent with each other, the job table is exact
+NAN_METHOD(stats) {
+    auto num = [](const v8::Local<v8::Object>& obj, const char* name, double value) {
+        Nan::Set(obj, Nan::New(name).ToLocalChecked(), Nan::New<v8::Number>(value));
+    };
+    auto str = [](const v8::Local<v8::Object>& obj, const char* name, const std::string& value) {
+        Nan::Set(obj, Nan::New(name).ToLocalChecked(), Nan::New(value).ToLocalChecked());
+    };
+    auto flag = [](const v8::Local<v8::Object>& obj, const char* name, bool value) {
+        Nan::Set(obj, Nan::New(name).ToLocalChecked(), Nan::New(value));
+    };
+
+    const auto stats = Job::stats();
+    auto ret = Nan::New<v8::Object>();
+
+    auto counters = Nan::New<v8::Object>();
+    num(counters, "started", stats.started);
+    num(counters, "finished", stats.finished);
+    num(counters, "failed", stats.failed);
+    num(counters, "timedOut", stats.timedOut);
+    num(counters, "processes", stats.processes);
+    num(counters, "builtins", stats.builtins);
+    num(counters, "reaped", stats.reaped);
+    num(counters, "sigchld", stats.sigchld);
+    num(counters, "reapLatencyTotal", stats.reapLatencyTotal);
+    num(counters, "reapLatencyMax", stats.reapLatencyMax);
+    num(counters, "bytesRead", stats.bytesRead);
+    num(counters, "bytesWritten", stats.bytesWritten);
+    num(counters, "bytesSpliced", stats.bytesSpliced);
+    Nan::Set(ret, Nan::New("counters").ToLocalChecked(), counters);
+
+    auto readers = Nan::New<v8::Array>(stats.readers.size());
+    for (size_t i = 0; i < stats.readers.size(); ++i) {
+        const auto& r = stats.readers[i];
+        auto reader = Nan::New<v8::Object>();
+        num(reader, "jobs", r.jobs);
+        num(reader, "fds", r.fds);
+        num(reader, "pidfds", r.pidfds);
+        num(reader, "wakeups", r.wakeups);
+        Nan::Set(readers, i, reader);
+    }
+    Nan::Set(ret, Nan::New("readers").ToLocalChecked(), readers);
+
+    const auto signal = SignalBase::stats();
+    auto signals = Nan::New<v8::Object>();
+    num(signals, "posted", signal.posted);
+    num(signals, "called", signal.called);
+    num(signals, "dropped", signal.dropped);
+    num(signals, "wakeups", signal.wakeups);
+    num(signals, "pending", signal.posted - signal.called - signal.dropped);
+    Nan::Set(ret, Nan::New("signals").ToLocalChecked(), signals);
+
+    num(ret, "unreaped", stats.unreaped);
+    num(ret, "timers", TimerWheel::size());
+
+    const auto all = Job::jobs();
+    auto jobs = Nan::New<v8::Array>(all.size());
+    for (size_t i = 0; i < all.size(); ++i) {
+        const auto& j = all[i];
+        auto job = Nan::New<v8::Object>();
+        num(job, "id", j->id());
+        str(job, "command", j->command());
+        const char* state = "running";
+        if (j->isStarting())
+            state = "starting";
+        else if (j->isTerminated())
+            state = "terminated";
+        else if (j->isStopped())
+            state = "stopped";
+        str(job, "state", state);
+        num(job, "pgid", j->pgid());
+        num(job, "reader", j->readerIndex());
+
+        const auto& procs = j->processes();
+        auto processes = Nan::New<v8::Array>(procs.size());
+        for (size_t p = 0; p < procs.size(); ++p) {
+            static const char* names[] = { "created", "running", "stopped", "terminated" };
+            auto proc = Nan::New<v8::Object>();
+            num(proc, "pid", procs[p].pid());
+            str(proc, "path", procs[p].path());
+            str(proc, "state", names[procs[p].state()]);
+            Nan::Set(processes, p, proc);
+        }
+        Nan::Set(job, Nan::New("processes").ToLocalChecked(), processes);
+
+        auto in = Nan::New<v8::Object>();
+        num(in, "written", j->stdinBytes());
+        num(in, "queued", j->stdinQueued());
+        Nan::Set(job, Nan::New("stdin").ToLocalChecked(), in);
+        auto out = Nan::New<v8::Object>();
+        num(out, "read", j->stdoutBytes());
+        Nan::Set(job, Nan::New("stdout").ToLocalChecked(), out);
+        auto err = Nan::New<v8::Object>();
+        num(err, "read", j->stderrBytes());
+        Nan::Set(job, Nan::New("stderr").ToLocalChecked(), err);
+
+        num(job, "queued", j->queuedBytes());
+        flag(job, "paused", j->isPaused());
+        flag(job, "throttled", j->isThrottled());
+        flag(job, "timedOut", j->isTimedOut());
+        Nan::Set(jobs, i, job);
+    }
+    Nan::Set(ret, Nan::New("jobs").ToLocalChecked(), jobs);
+
+    info.GetReturnValue().Set(ret);
+}
+
+// the PATH to look in, our own unless one is passed as the argument at idx
+static std::string pathArgument(Nan::NAN_METHOD_ARGS_TYPE info, int idx)
+{
+    if (info.Length() > idx && info[idx]->IsString())
+        return *Nan::Utf8String(info[idx]);
+    const char* path = getenv("PATH");
+    return path ? path : std::string();
+}
+
+NAN_METHOD(which) {
+    if (info.Length() < 1 || !info[0]->IsString()) {
+        Nan::ThrowError("which takes a command name");
+        return;
+    }
+    const std::string file = CommandHash::find(pathArgument(info, 1), *Nan::Utf8String(info[0]));
+    if (!file.empty())
+        info.GetReturnValue().Set(makeValue(file));
+}
+
+NAN_METHOD(commands) {
+    const auto cmds = CommandHash::commands(pathArgument(info, 0));
+
+    auto ret = Nan::New<v8::Array>(cmds.size());
+    for (uint32_t idx = 0; idx < cmds.size(); ++idx) {
+        Nan::Set(ret, idx, makeValue(cmds[idx]));
+    }
+    info.GetReturnValue().Set(ret);
+}
+
+NAN_METHOD(rehash) {
+    CommandHash::clear();
+}
+
+NAN_METHOD(builtins) {
+    const auto names = Builtin::names();
+
+    auto ret = Nan::New<v8::Array>(names.size());
+    for (uint32_t idx = 0; idx < names.size(); ++idx) {
+        Nan::Set(ret, idx, makeValue(names[idx]));
+    }
+    info.GetReturnValue().Set(ret);
+}
+
+// reads all own properties of obj as strings, false if they can't be had
+static bool toMap(const v8::Local<v8::Object>& obj, Environment::Map& map)
+{
+    auto maybeProps = Nan::GetOwnPropertyNames(obj);
+    if (maybeProps.IsEmpty())
+        return false;
+    auto props = maybeProps.ToLocalChecked();
+    for (uint32_t i = 0; i < props->Length(); ++i) {
+        auto key = props->Get(i);
+        map[*Nan::Utf8String(key)] = *Nan::Utf8String(obj->Get(key));
+    }
+    return true;
+}
+
+namespace environment {
+
+// the shell keeps its environment in one of these and updates it as
+// variables change, jobs then share its envp instead of each getting
+// a copy of every variable
+class NanEnviron : public Nan::ObjectWrap
+{
+public:
+    Environment env;
+
+    static Nan::Persistent<v8::FunctionTemplate> constructor;
+};
+
+Nan::Persistent<v8::FunctionTemplate> NanEnviron::constructor;
+
+NAN_METHOD(New) {
+    if (!info.IsConstructCall()) {
+        Nan::ThrowError("Need to instantiate Environ through new()");
+        return;
+    }
+
+    Environment::Map vars;
+    if (info.Length() > 0 && info[0]->IsObject()) {
+        if (!toMap(v8::Local<v8::Object>::Cast(info[0]), vars)) {
+            Nan::ThrowError("Environ can't get properties");
+            return;
+        }
+    }
+
+    auto environ = new NanEnviron;
+    environ->env = Environment(std::move(vars));
+    environ->Wrap(info.This());
+}
+
+NAN_METHOD(Set) {
+    if (info.Length() < 2 || !info[0]->IsString()) {
+        Nan::ThrowError("Environ.set takes a key and a value");
+        return;
+    }
+    auto environ = Nan::ObjectWrap::Unwrap<NanEnviron>(info.Holder());
+    environ->env.set(*Nan::Utf8String(info[0]), *Nan::Utf8String(info[1]));
+}
+
+NAN_METHOD(Unset) {
+    if (info.Length() < 1 || !info[0]->IsString()) {
+        Nan::ThrowError("Environ.unset takes a key");
+        return;
+    }
+    auto environ = Nan::ObjectWrap::Unwrap<NanEnviron>(info.Holder());
+    environ->env.unset(*Nan::Utf8String(info[0]));
+}
+
+NAN_METHOD(Get) {
+    if (info.Length() < 1 || !info[0]->IsString()) {
+        Nan::ThrowError("Environ.get takes a key");
+        return;
+    }
+    auto environ = Nan::ObjectWrap::Unwrap<NanEnviron>(info.Holder());
+    const auto& vars = environ->env.vars();
+    auto it = vars.find(*Nan::Utf8String(info[0]));
+    if (it != vars.end())
+        info.GetReturnValue().Set(makeValue(it->second));
+}
+
+NAN_GETTER(Version) {
+    auto environ = Nan::ObjectWrap::Unwrap<NanEnviron>(info.Holder());
+    info.GetReturnValue().Set(Nan::New<v8::Number>(environ->env.version()));
+}
+
+} // namespace environment
+
 namespace job {
 
+static void setUsage(const v8::Local<v8::Object>& obj, const Process::Usage& usage)
+{
+    Nan::Set(obj, Nan::New("user").ToLocalChecked(), Nan::New<v8::Number>(usage.user / 1000.));
+    Nan::Set(obj, Nan::New("system").ToLocalChecked(), Nan::New<v8::Number>(usage.system / 1000.));
+    Nan::Set(obj, Nan::New("maxRss").ToLocalChecked(), Nan::New<v8::Number>(usage.maxRss));
+    Nan::Set(obj, Nan::New("minorFaults").ToLocalChecked(), Nan::New<v8::Number>(usage.minorFaults));
+    Nan::Set(obj, Nan::New("majorFaults").ToLocalChecked(), Nan::New<v8::Number>(usage.majorFaults));
+    Nan::Set(obj, Nan::New("voluntarySwitches").ToLocalChecked(), Nan::New<v8::Number>(usage.voluntarySwitches));
+    Nan::Set(obj, Nan::New("involuntarySwitches").ToLocalChecked(), Nan::New<v8::Number>(usage.involuntarySwitches));
+}
+
+// what the job and each of its processes used, times in milliseconds
+static v8::Local<v8::Object> makeStats(const std::shared_ptr<Job>& job)
+{
+    auto obj = Nan::New<v8::Object>();
+    Nan::Set(obj, Nan::New("real").ToLocalChecked(), Nan::New<v8::Number>(job->elapsed() / 1000.));
+    Nan::Set(obj, Nan::New("timedOut").ToLocalChecked(), Nan::New<v8::Boolean>(job->isTimedOut()));
+    setUsage(obj, job->usage());
+
+    const auto& procs = job->processes();
+    auto array = Nan::New<v8::Array>(procs.size());
+    for (uint32_t i = 0; i < procs.size(); ++i) {
+        const Process& proc = procs[i];
+        auto p = Nan::New<v8::Object>();
+        Nan::Set(p, Nan::New("path").ToLocalChecked(), makeValue(proc.path()));
+        Nan::Set(p, Nan::New("pid").ToLocalChecked(), Nan::New<v8::Int32>(proc.pid()));
+        if (proc.state() == Process::Terminated)
+            Nan::Set(p, Nan::New("status").ToLocalChecked(), Nan::New<v8::Int32>(proc.status()));
+        setUsage(p, proc.usage());
+        Nan::Set(array, i, p);
+    }
+    Nan::Set(obj, Nan::New("processes").ToLocalChecked(), array);
+    return obj;
+}
+
+// wraps a chunk in a node buffer without copying, the buffer
+// keeps the slab alive until it's garbage collected
+static v8::Local<v8::Value> makeBuffer(Buffer::Chunk&& chunk)
+{
+    Slab* slab = chunk.slab.release();
+    auto free = [](char*, void* hint) {
+        static_cast<Slab*>(hint)->deref();
+    };
+    return Nan::NewBuffer(reinterpret_cast<char*>(slab->data() + chunk.offset), chunk.size, free, slab).ToLocalChecked();
+}
+
+// splits buffer on delim and returns an array with one node buffer per
+// record, without the delimiters. records that sit in a single slab are
+// not copied, only the ones straddling two chunks are
+static v8::Local<v8::Value> makeRecords(Buffer& buffer, uint8_t delim)
+{
+    auto records = Nan::New<v8::Array>();
+    uint32_t idx = 0;
+    // pieces of a record that started in an earlier chunk
+    std::vector<Buffer::Chunk> partial;
+    auto add = [&](Buffer::Chunk&& tail) {
+        if (partial.empty()) {
+            Nan::Set(records, idx++, makeBuffer(std::move(tail)));
+            return;
+        }
+        size_t size = tail.size;
+        for (const auto& piece : partial)
+            size += piece.size;
+        auto record = Nan::NewBuffer(size).ToLocalChecked();
+        char* out = node::Buffer::Data(record);
+        for (const auto& piece : partial) {
+            memcpy(out, piece.data(), piece.size);
+            out += piece.size;
+        }
+        if (tail.size)
+            memcpy(out, tail.data(), tail.size);
+        partial.clear();
+        Nan::Set(records, idx++, record);
+    };
+    while (buffer.chunkCount()) {
+        Buffer::Chunk chunk = buffer.takeChunk();
+        const uint8_t* data = chunk.data();
+        size_t off = 0;
+        while (off < chunk.size) {
+            const void* found = memchr(data + off, delim, chunk.size - off);
+            if (!found)
+                break;
+            const size_t end = static_cast<const uint8_t*>(found) - data;
+            add(Buffer::Chunk { chunk.slab, chunk.offset + off, end - off });
+            off = end + 1;
+        }
+        if (off < chunk.size)
+            partial.push_back(Buffer::Chunk { std::move(chunk.slab), chunk.offset + off, chunk.size - off });
+    }
+    // the last record of a closed fd doesn't need a delimiter
+    if (!partial.empty())
+        add(Buffer::Chunk { SlabRef(), 0, 0 });
+    return records;
+}
+
+// a capture is posted once, as one buffer. we only copy if the
+// output didn't fit in a single slab
+static v8::Local<v8::Value> makeCapture(Buffer& buffer)
+{
+    if (buffer.chunkCount() == 1)
+        return makeBuffer(buffer.takeChunk());
+    auto capture = Nan::NewBuffer(buffer.size()).ToLocalChecked();
+    buffer.read(reinterpret_cast<uint8_t*>(node::Buffer::Data(capture)), buffer.size());
+    return capture;
+}
+
 class NanJob : public Nan::ObjectWrap
 {
 public:
@@ -137,42 +532,103 @@ public:
     {
         dead = std::make_shared<int>();
         std::weak_ptr<int> weak = dead;
-        auto onout = [weak](const auto& /*job*/, auto& buffer, auto cb) {
+        auto onout = [weak](const auto& job, auto& buffer, auto cb, Job::Io io) {
+            // whatever happens below, this is no longer queued
+            job->delivered(buffer.size());
             if (std::shared_ptr<int> d = weak.lock()) {
+                if (cb->IsEmpty() || buffer.empty())
+                    return;
                 Nan::HandleScope scope;
-                auto data = buffer.readAll();
-                auto nodeBuffer = v8::Local<v8::Value>::Cast(Nan::CopyBuffer(reinterpret_cast<char*>(&data[0]), data.size()).ToLocalChecked());
-                if (!cb->IsEmpty())
-                    cb->Call(1, &nodeBuffer);
+                // node buffers point straight into our slabs, more than
+                // one chunk is delivered as an array of buffers
+                v8::Local<v8::Value> value;
+                const size_t count = buffer.chunkCount();
+                const int delim = job->delimiter();
+                if (io == Job::Stdout && job->isCapturing()) {
+                    value = makeCapture(buffer);
+                } else if (delim != Job::NoDelimiter) {
+                    value = makeRecords(buffer, static_cast<uint8_t>(delim));
+                } else if (count == 1) {
+                    value = makeBuffer(buffer.takeChunk());
+                } else {
+                    auto array = Nan::New<v8::Array>(count);
+                    for (uint32_t i = 0; i < count; ++i) {
+                        Nan::Set(array, i, makeBuffer(buffer.takeChunk()));
+                    }
+                    value = array;
+                }
+                cb->Call(1, &value);
             }
         };
 
         // apparently we can't bind Nan::Callback as value
-        job->stdout().on(bind(onout, _1, _2, &onStdOut));
-        job->stderr().on(bind(onout, _1, _2, &onStdErr));
+        job->stdout().on(bind(onout, _1, _2, &onStdOut, Job::Stdout));
+        job->stderr().on(bind(onout, _1, _2, &onStdErr, Job::Stderr));
+
+        job->stdinWritten().on([weak, this](const auto& job, size_t done, bool drain) {
+                if (std::shared_ptr<int> d = weak.lock()) {
+                    // the reader is done with these, node can have them back
+                    releaseStdin(done);
+                    if (drain && !onDrain.IsEmpty()) {
+                        Nan::HandleScope scope;
+                        onDrain.Call(0, 0);
+                    }
+                }
+            });
 
         job->stateChanged().on(bind([weak, this](const auto& job, auto state, int status, auto cbs) {
                     if (std::shared_ptr<int> d = weak.lock()) {
                         Nan::HandleScope scope;
+                        // the job is let go of once it's terminated,
+                        // stats() keeps returning what it used
+                        v8::Local<v8::Object> stats;
+                        if (state == Job::Terminated) {
+                            stats = makeStats(job);
+                            finalStats.Reset(stats);
+                        }
                         for (auto cb : *cbs) {
                             if (!cb->IsEmpty()) {
                                 std::vector<v8::Local<v8::Value> > ret;
                                 ret.push_back(v8::Local<v8::Value>::Cast(Nan::New<v8::Uint32>(state)));
                                 ret.push_back(v8::Local<v8::Value>::Cast(Nan::New<v8::Int32>(status)));
+                                // failures come with an errno and a message,
+                                // terminated jobs with what they used
+                                if (state == Job::Failed)
+                                    ret.push_back(makeValue(job->failure()));
+                                else if (state == Job::Terminated)
+                                    ret.push_back(stats);
                                 cb->Call(ret.size(), &ret[0]);
                             }
                         }
-                        if (state == Job::Terminated)
+                        if (state == Job::Terminated) {
+                            this->job->discardStdin();
+                            releaseStdin(stdinBuffers.size());
                             this->job.reset();
+                        }
                     }
                 }, _1, _2, _3, &onStateChanged));
     }
     ~NanJob()
     {
         if (job) {
+            // output that's already posted is still delivered, anything
+            // after this isn't counted. nobody is left to resume() it
             job->stdout().off();
             job->stderr().off();
+            job->resume();
             job->stateChanged().off();
+            job->stdinWritten().off();
+            job->discardStdin();
+        }
+        releaseStdin(stdinBuffers.size());
+    }
+
+    void releaseStdin(size_t count)
+    {
+        count = std::min(count, stdinBuffers.size());
+        for (size_t i = 0; i < count; ++i) {
+            stdinBuffers.front()->Reset();
+            stdinBuffers.pop_front();
         }
     }
 
@@ -187,13 +643,19 @@ public:
     std::shared_ptr<Job> job;
     uint32_t id;
 
-    Nan::Callback onStdOut, onStdErr;
+    // node buffers passed to write() that the reader still points into
+    std::deque<std::unique_ptr<Nan::Persistent<v8::Object> > > stdinBuffers;
+
+    Nan::Callback onStdOut, onStdErr, onDrain;
     std::vector<std::shared_ptr<Nan::Callback> > onStateChanged;
+    Nan::Persistent<v8::Object> finalStats;
 
     static uint32_t nextId;
+    static Nan::Persistent<v8::FunctionTemplate> constructor;
 };
 
 uint32_t NanJob::nextId = 0;
+Nan::Persistent<v8::FunctionTemplate> NanJob::constructor;
 
 NAN_METHOD(New) {
     if (!info.IsConstructCall()) {
@@ -252,9 +714,206 @@ NAN_METHOD(Start) {
         if (!(dupmode & Job::DupStderr) && !job->onStdErr.IsEmpty())
             dupmode |= Job::DupStderr;
     }
+    if (!job->job) {
+        Nan::ThrowError("Job.start on a finished job");
+        return;
+    }
     job->job->start(m, dupmode);
 }
 
+// <<- drops the tabs every line of the document starts with
+static std::string stripTabs(const std::string& doc)
+{
+    std::string out;
+    out.reserve(doc.size());
+    bool start = true;
+    for (char c : doc) {
+        if (start && c == '\t')
+            continue;
+        start = c == '\n';
+        out += c;
+    }
+    return out;
+}
+
+static const struct {
+    const char* name;
+    int signal;
+} signalNames[] = {
+    { "HUP", SIGHUP },
+    { "INT", SIGINT },
+    { "QUIT", SIGQUIT },
+    { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 },
+    { "USR2", SIGUSR2 },
+    { "ALRM", SIGALRM },
+    { "TERM", SIGTERM },
+};
+
+static const struct {
+    const char* name;
+    int resource;
+} limitNames[] = {
+    { "as", RLIMIT_AS },
+    { "core", RLIMIT_CORE },
+    { "cpu", RLIMIT_CPU },
+    { "data", RLIMIT_DATA },
+    { "fsize", RLIMIT_FSIZE },
+    { "locks", RLIMIT_LOCKS },
+    { "memlock", RLIMIT_MEMLOCK },
+    { "msgqueue", RLIMIT_MSGQUEUE },
+    { "nice", RLIMIT_NICE },
+    { "nofile", RLIMIT_NOFILE },
+    { "nproc", RLIMIT_NPROC },
+    { "rss", RLIMIT_RSS },
+    { "rtprio", RLIMIT_RTPRIO },
+    { "rttime", RLIMIT_RTTIME },
+    { "sigpending", RLIMIT_SIGPENDING },
+    { "stack", RLIMIT_STACK },
+    { 0, 0 }
+};
+
+// a limit is a number, Infinity or "unlimited"
+static bool toLimit(const v8::Local<v8::Value>& value, uint64_t& limit)
+{
+    if (value->IsString() && std::string(*Nan::Utf8String(value)) == "unlimited") {
+        limit = RLIM_INFINITY;
+        return true;
+    }
+    if (!value->IsNumber())
+        return false;
+    const double d = Nan::To<double>(value).FromJust();
+    if (d == std::numeric_limits<double>::infinity()) {
+        limit = RLIM_INFINITY;
+        return true;
+    }
+    if (d < 0 || d != static_cast<double>(static_cast<uint64_t>(d)))
+        return false;
+    limit = static_cast<uint64_t>(d);
+    return true;
+}
+
+// affinity: [cpu, ...], nice: -20 to 19, ioprio: "realtime", "best-effort",
+// "idle" or { class, level }, rlimits: { nofile: limit or [soft, hard], ... }
+// and cgroup: directory. throws and returns false if any of them are bad
+static bool toAttributes(const v8::Local<v8::Object>& obj, Process::Attributes& attrs)
+{
+    auto get = [](const v8::Local<v8::Object>& obj, const char* name) -> v8::Local<v8::Value> {
+        auto maybe = Nan::Get(obj, Nan::New(name).ToLocalChecked());
+        if (maybe.IsEmpty())
+            return Nan::Undefined();
+        return maybe.ToLocalChecked();
+    };
+
+    auto affinity = get(obj, "affinity");
+    if (!affinity->IsUndefined()) {
+        if (!affinity->IsArray()) {
+            Nan::ThrowError("Job.add affinity needs to be an array of cpus");
+            return false;
+        }
+        auto cpus = v8::Local<v8::Array>::Cast(affinity);
+        for (uint32_t i = 0; i < cpus->Length(); ++i) {
+            auto cpu = cpus->Get(i);
+            if (!cpu->IsUint32() || v8::Local<v8::Uint32>::Cast(cpu)->Value() >= CPU_SETSIZE) {
+                Nan::ThrowError("Job.add affinity cpus need to be numbers");
+                return false;
+            }
+            attrs.affinity.push_back(v8::Local<v8::Uint32>::Cast(cpu)->Value());
+        }
+    }
+
+    auto nice = get(obj, "nice");
+    if (!nice->IsUndefined()) {
+        const int value = nice->IsInt32() ? v8::Local<v8::Int32>::Cast(nice)->Value() : INT_MIN;
+        if (value < -20 || value > 19) {
+            Nan::ThrowError("Job.add nice needs to be a number from -20 to 19");
+            return false;
+        }
+        attrs.hasNice = true;
+        attrs.nice = value;
+    }
+
+    auto ioprio = get(obj, "ioprio");
+    if (!ioprio->IsUndefined()) {
+        v8::Local<v8::Value> cls = ioprio, level = Nan::Undefined();
+        if (ioprio->IsObject()) {
+            cls = get(v8::Local<v8::Object>::Cast(ioprio), "class");
+            level = get(v8::Local<v8::Object>::Cast(ioprio), "level");
+        }
+        const std::string name = cls->IsString() ? *Nan::Utf8String(cls) : std::string();
+        int value;
+        if (name == "realtime") {
+            value = 1;
+        } else if (name == "best-effort") {
+            value = 2;
+        } else if (name == "idle") {
+            value = 3;
+        } else {
+            Nan::ThrowError("Job.add ioprio class needs to be realtime, best-effort or idle");
+            return false;
+        }
+        // the level is meaningless for idle
+        uint32_t lvl = value == 3 ? 0 : 4;
+        if (!level->IsUndefined()) {
+            if (!level->IsUint32() || (lvl = v8::Local<v8::Uint32>::Cast(level)->Value()) > 7) {
+                Nan::ThrowError("Job.add ioprio level needs to be a number from 0 to 7");
+                return false;
+            }
+        }
+        attrs.ioprio = value << 13 | lvl;
+    }
+
+    auto rlimits = get(obj, "rlimits");
+    if (!rlimits->IsUndefined()) {
+        if (!rlimits->IsObject()) {
+            Nan::ThrowError("Job.add rlimits needs to be an object");
+            return false;
+        }
+        auto limitsObj = v8::Local<v8::Object>::Cast(rlimits);
+        auto maybeProps = Nan::GetOwnPropertyNames(limitsObj);
+        if (maybeProps.IsEmpty()) {
+            Nan::ThrowError("Job.add rlimits can't get properties");
+            return false;
+        }
+        auto props = maybeProps.ToLocalChecked();
+        for (uint32_t i = 0; i < props->Length(); ++i) {
+            const std::string key = *Nan::Utf8String(props->Get(i));
+            auto cur = limitNames;
+            while (cur->name && key != cur->name)
+                ++cur;
+            if (!cur->name) {
+                Nan::ThrowError(("Job.add unknown rlimit " + key).c_str());
+                return false;
+            }
+            auto value = get(limitsObj, cur->name);
+            Process::Attributes::Limit limit = { cur->resource, 0, 0 };
+            bool ok;
+            if (value->IsArray() && v8::Local<v8::Array>::Cast(value)->Length() == 2) {
+                auto pair = v8::Local<v8::Array>::Cast(value);
+                ok = toLimit(pair->Get(0), limit.soft) && toLimit(pair->Get(1), limit.hard);
+            } else {
+                ok = toLimit(value, limit.soft);
+                limit.hard = limit.soft;
+            }
+            if (!ok) {
+                Nan::ThrowError(("Job.add rlimit " + key + " needs to be a limit or [soft, hard]").c_str());
+                return false;
+            }
+            attrs.limits.push_back(limit);
+        }
+    }
+
+    auto cgroup = get(obj, "cgroup");
+    if (!cgroup->IsUndefined()) {
+        if (!cgroup->IsString()) {
+            Nan::ThrowError("Job.add cgroup needs to be a directory");
+            return false;
+        }
+        attrs.cgroup = *Nan::Utf8String(cgroup);
+    }
+    return true;
+}
+
 NAN_METHOD(Add) {
     if (info.Length() < 1 || !info[0]->IsObject()) {
         Nan::ThrowError("Job.add takes an object argument");
@@ -294,29 +953,34 @@ NAN_METHOD(Add) {
         }
     }
 
+    // environ is either an Environ, which is shared, or a plain object
     auto maybeEnviron = Nan::Get(obj, Nan::New("environ").ToLocalChecked());
     if (!maybeEnviron.IsEmpty()) {
         auto environ = maybeEnviron.ToLocalChecked();
-        if (environ->IsObject()) {
-            auto environObject = v8::Local<v8::Object>::Cast(environ);
-            auto maybeProps = Nan::GetOwnPropertyNames(environObject);
-            if (maybeProps.IsEmpty()) {
+        if (Nan::New(environment::NanEnviron::constructor)->HasInstance(environ)) {
+            auto nanEnviron = Nan::ObjectWrap::Unwrap<environment::NanEnviron>(v8::Local<v8::Object>::Cast(environ));
+            proc.setEnviron(nanEnviron->env.snapshot());
+        } else if (environ->IsObject()) {
+            Environment::Map vars;
+            if (!toMap(v8::Local<v8::Object>::Cast(environ), vars)) {
                 Nan::ThrowError("Job.add environ can't get properties");
                 return;
             }
-            auto props = maybeProps.ToLocalChecked();
-            if (!props->IsArray()) {
-                // seems impossible?
-                Nan::ThrowError("Job.add environ props is not an array");
+            proc.setEnviron(Environment(std::move(vars)).snapshot());
+        }
+    }
+
+    // variables for this process only
+    auto maybeAssigns = Nan::Get(obj, Nan::New("assigns").ToLocalChecked());
+    if (!maybeAssigns.IsEmpty()) {
+        auto assigns = maybeAssigns.ToLocalChecked();
+        if (assigns->IsObject()) {
+            Process::Environ procAssigns;
+            if (!toMap(v8::Local<v8::Object>::Cast(assigns), procAssigns)) {
+                Nan::ThrowError("Job.add assigns can't get properties");
                 return;
             }
-            Process::Environ procEnviron;
-            auto propsArray = v8::Local<v8::Array>::Cast(props);
-            for (uint32_t i = 0; i < propsArray->Length(); ++i) {
-                auto val = environObject->Get(propsArray->Get(i));
-                procEnviron[*Nan::Utf8String(propsArray->Get(i))] = *Nan::Utf8String(val);
-            }
-            proc.setEnviron(std::move(procEnviron));
+            proc.setAssigns(std::move(procAssigns));
         }
     }
 
@@ -352,26 +1016,42 @@ NAN_METHOD(Add) {
                     Nan::ThrowError("Job.add redirect file needs to be a string");
                     return;
                 }
-                int fromfd = 1, tofd = -1;
-                bool append = false;
-                std::string fname;
                 const std::string op = *Nan::Utf8String(opVal);
+                // input redirects are to stdin unless told otherwise
+                int fromfd = op[0] == '<' ? 0 : 1, tofd = -1;
+                auto mode = Process::Redirect::Write;
+                std::string fname;
 
-                if (op == ">&") {
+                if (op == ">&" || op == "<&") {
                     // file is a file descriptor
                     char* end = 0;
                     Nan::Utf8String utf8(fileVal);
                     tofd = strtol(*utf8, &end, 10);
                     if (tofd < 0 || !end || *end != '\0') {
                         // bad
-                        Nan::ThrowError("Job.add redirect, file needs to be a positive number for >&");
+                        Nan::ThrowError(("Job.add redirect, file needs to be a positive number for " + op).c_str());
                         return;
                     }
                 } else {
-                    // file is a file
-                    if (op == ">>")
-                        append = true;
                     fname = *Nan::Utf8String(fileVal);
+                    if (op == ">" || op == ">|") {
+                        mode = Process::Redirect::Write;
+                    } else if (op == ">>") {
+                        mode = Process::Redirect::Append;
+                    } else if (op == "<") {
+                        mode = Process::Redirect::Read;
+                    } else if (op == "<<" || op == "<<-" || op == "<<<") {
+                        // file is the document itself, the here-string
+                        // gets the newline a here-document ends with
+                        mode = Process::Redirect::Document;
+                        if (op == "<<-")
+                            fname = stripTabs(fname);
+                        else if (op == "<<<")
+                            fname += '\n';
+                    } else {
+                        Nan::ThrowError(("Job.add unknown redirect op " + op).c_str());
+                        return;
+                    }
                 }
 
                 if (redirObj->Has(ioKey)) {
@@ -382,38 +1062,208 @@ NAN_METHOD(Add) {
                     }
                     fromfd = v8::Local<v8::Int32>::Cast(ioVal)->Value();
                 }
-                Process::Redirect procRedir = { fromfd, tofd, fname, append };
+                Process::Redirect procRedir = { fromfd, tofd, fname, mode };
                 procRedirs.push_back(std::move(procRedir));
             }
             proc.setRedirects(std::move(procRedirs));
         }
     }
 
+    Process::Attributes attrs;
+    if (!toAttributes(obj, attrs))
+        return;
+    proc.setAttributes(std::move(attrs));
+
     auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
+    if (!job) {
+        Nan::ThrowError("Job.add on a finished job");
+        return;
+    }
     job->add(std::move(proc));
 }
 
+// like a stream, true when the data was queued and false when it was
+// queued but the caller should wait for "drain" before writing more.
+// null when stdin is closed or the job is gone, the data is dropped
+// and no "drain" is coming
 NAN_METHOD(Write) {
-    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
-    if (info.Length() >= 1) {
-        if (info[0]->IsString()) {
-            Nan::Utf8String str(info[0]);
-            job->write(reinterpret_cast<uint8_t*>(*str), str.length());
-        } else if (info[0]->IsObject() && node::Buffer::HasInstance(info[0])) {
-            auto data = node::Buffer::Data(info[0]);
-            auto len = node::Buffer::Length(info[0]);
-            job->write(reinterpret_cast<uint8_t*>(data), len);
-        } else {
-            Nan::ThrowError("Job.write invalid argument");
-        }
-    } else {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder());
+    if (info.Length() < 1) {
         Nan::ThrowError("Job.write takes a string or buffer argument");
+        return;
+    }
+    v8::Local<v8::Object> buffer;
+    if (info[0]->IsString()) {
+        Nan::Utf8String str(info[0]);
+        buffer = Nan::CopyBuffer(*str, str.length()).ToLocalChecked();
+    } else if (info[0]->IsObject() && node::Buffer::HasInstance(info[0])) {
+        buffer = v8::Local<v8::Object>::Cast(info[0]);
+    } else {
+        Nan::ThrowError("Job.write invalid argument");
+        return;
+    }
+    if (!job->job) {
+        info.GetReturnValue().SetNull();
+        return;
+    }
+    // the reader writes straight out of the node buffer, keep it alive
+    // until stdinWritten says it's done with it
+    const auto data = reinterpret_cast<const uint8_t*>(node::Buffer::Data(buffer));
+    const auto len = node::Buffer::Length(buffer);
+    if (len)
+        job->stdinBuffers.push_back(std::make_unique<Nan::Persistent<v8::Object> >(buffer));
+    const auto status = job->job->write(data, len);
+    if (status == Job::WriteClosed && len) {
+        job->stdinBuffers.back()->Reset();
+        job->stdinBuffers.pop_back();
     }
+    if (status == Job::WriteClosed)
+        info.GetReturnValue().SetNull();
+    else
+        info.GetReturnValue().Set(Nan::New<v8::Boolean>(status == Job::WriteOk));
 }
 
 NAN_METHOD(Close) {
     auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
-    job->close();
+    if (job)
+        job->close();
+}
+
+NAN_METHOD(PipeTo) {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder());
+    if (info.Length() < 1 || !Nan::New(NanJob::constructor)->HasInstance(info[0])) {
+        Nan::ThrowError("Job.pipeTo takes a Job argument");
+        return;
+    }
+    auto target = Nan::ObjectWrap::Unwrap<NanJob>(v8::Local<v8::Object>::Cast(info[0]));
+    if (!job->job || !target->job) {
+        Nan::ThrowError("Job.pipeTo on a finished job");
+        return;
+    }
+    job->job->pipeTo(target->job);
+    job->job->setPipeTee(!job->onStdOut.IsEmpty());
+}
+
+NAN_METHOD(Pause) {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
+    if (job)
+        job->pause();
+}
+
+NAN_METHOD(Resume) {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
+    if (job)
+        job->resume();
+}
+
+NAN_METHOD(SetWatermarks) {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
+    if (info.Length() < 2 || !info[0]->IsNumber() || !info[1]->IsNumber()) {
+        Nan::ThrowError("Job.setWatermarks takes a high and a low (number) argument");
+        return;
+    }
+    const double high = v8::Local<v8::Number>::Cast(info[0])->Value();
+    const double low = v8::Local<v8::Number>::Cast(info[1])->Value();
+    if (high <= 0 || low < 0 || low > high) {
+        Nan::ThrowError("Job.setWatermarks needs 0 <= low <= high and high > 0");
+        return;
+    }
+    if (job)
+        job->setWatermarks(static_cast<size_t>(high), static_cast<size_t>(low));
+}
+
+NAN_METHOD(SetCoalesce) {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
+    if (info.Length() < 2 || !info[0]->IsUint32() || !info[1]->IsUint32()) {
+        Nan::ThrowError("Job.setCoalesce takes a bytes and a microseconds (number) argument");
+        return;
+    }
+    const uint32_t bytes = v8::Local<v8::Uint32>::Cast(info[0])->Value();
+    const uint32_t usecs = v8::Local<v8::Uint32>::Cast(info[1])->Value();
+    if (job)
+        job->setCoalesce(bytes, usecs);
+}
+
+// setTimeout(ms, { signal, graceMs }), signal is a number or a name
+// like "SIGINT" or "INT". 0 ms takes the deadline away
+NAN_METHOD(SetTimeout) {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
+    if (info.Length() < 1 || !info[0]->IsNumber() || info[0]->NumberValue() < 0) {
+        Nan::ThrowError("Job.setTimeout takes a milliseconds (number) argument");
+        return;
+    }
+    const uint64_t ms = static_cast<uint64_t>(info[0]->NumberValue());
+    int sig = SIGTERM;
+    uint64_t grace = Job::DefaultTimeoutGrace;
+    if (info.Length() > 1 && info[1]->IsObject()) {
+        auto opts = v8::Local<v8::Object>::Cast(info[1]);
+        auto maybeSignal = Nan::Get(opts, Nan::New("signal").ToLocalChecked());
+        if (!maybeSignal.IsEmpty() && !maybeSignal.ToLocalChecked()->IsUndefined()) {
+            auto value = maybeSignal.ToLocalChecked();
+            sig = 0;
+            if (value->IsInt32()) {
+                sig = v8::Local<v8::Int32>::Cast(value)->Value();
+            } else if (value->IsString()) {
+                std::string name = *Nan::Utf8String(value);
+                if (name.compare(0, 3, "SIG") == 0)
+                    name = name.substr(3);
+                for (const auto& s : signalNames) {
+                    if (name == s.name) {
+                        sig = s.signal;
+                        break;
+                    }
+                }
+            }
+            if (sig <= 0 || sig >= NSIG) {
+                Nan::ThrowError("Job.setTimeout signal needs to be a signal number or name");
+                return;
+            }
+        }
+        auto maybeGrace = Nan::Get(opts, Nan::New("graceMs").ToLocalChecked());
+        if (!maybeGrace.IsEmpty() && !maybeGrace.ToLocalChecked()->IsUndefined()) {
+            auto value = maybeGrace.ToLocalChecked();
+            if (!value->IsNumber() || value->NumberValue() < 0) {
+                Nan::ThrowError("Job.setTimeout graceMs needs to be a positive number");
+                return;
+            }
+            grace = static_cast<uint64_t>(value->NumberValue());
+        }
+    } else if (info.Length() > 1 && !info[1]->IsUndefined()) {
+        Nan::ThrowError("Job.setTimeout options need to be an object");
+        return;
+    }
+    if (job)
+        job->setTimeout(ms, sig, grace);
+}
+
+NAN_METHOD(SetDelimiter) {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
+    int delim = Job::NoDelimiter;
+    if (info.Length() > 0 && info[0]->IsString()) {
+        Nan::Utf8String str(info[0]);
+        if (str.length() != 1) {
+            Nan::ThrowError("Job.setDelimiter takes a single byte delimiter");
+            return;
+        }
+        delim = static_cast<uint8_t>((*str)[0]);
+    } else if (info.Length() > 0 && info[0]->IsUint32()) {
+        const uint32_t d = v8::Local<v8::Uint32>::Cast(info[0])->Value();
+        if (d > std::numeric_limits<uint8_t>::max()) {
+            Nan::ThrowError("Job.setDelimiter delimiter out of range");
+            return;
+        }
+        delim = static_cast<int>(d);
+    } else if (info.Length() > 0 && !info[0]->IsNull() && !info[0]->IsUndefined()) {
+        Nan::ThrowError("Job.setDelimiter takes a string, a number or null");
+        return;
+    }
+    if (job)
+        job->setDelimiter(delim);
+}
+
+NAN_GETTER(QueuedBytes) {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
+    info.GetReturnValue().Set(Nan::New<v8::Number>(job ? job->queuedBytes() : 0));
 }
 
 NAN_METHOD(SetMode) {
@@ -439,24 +1289,40 @@ NAN_METHOD(SetMode) {
         Nan::ThrowError("Job.start takes a mode argument");
         return;
     }
-    job->setMode(m, true);
+    if (job)
+        job->setMode(m, true);
 }
 
 NAN_METHOD(Command) {
     auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder())->job;
+    if (!job)
+        return;
     const auto& cmd = job->command();
     if (!cmd.empty())
         info.GetReturnValue().Set(Nan::New(cmd.c_str()).ToLocalChecked());
 }
 
+NAN_METHOD(Stats) {
+    auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder());
+    if (job->job)
+        info.GetReturnValue().Set(makeStats(job->job));
+    else
+        info.GetReturnValue().Set(Nan::New(job->finalStats));
+}
+
 NAN_METHOD(On) {
     auto job = Nan::ObjectWrap::Unwrap<NanJob>(info.Holder());
     if (info.Length() >= 2 && info[0]->IsString() && info[1]->IsFunction()) {
         const std::string str = *Nan::Utf8String(info[0]);
         if (str == "stdout") {
             job->onStdOut.Reset(v8::Local<v8::Function>::Cast(info[1]));
+            // if our stdout is spliced somewhere we need to see it as well
+            if (job->job)
+                job->job->setPipeTee(true);
         } else if (str == "stderr") {
             job->onStdErr.Reset(v8::Local<v8::Function>::Cast(info[1]));
+        } else if (str == "drain") {
+            job->onDrain.Reset(v8::Local<v8::Function>::Cast(info[1]));
         } else if (str == "stateChanged") {
             job->onStateChanged.push_back(std::make_shared<Nan::Callback>(v8::Local<v8::Function>::Cast(info[1])));
         } else {
@@ -474,6 +1340,28 @@ NAN_MODULE_INIT(Initialize) {
     NAN_EXPORT(target, deinit);
     NAN_EXPORT(target, restore);
     NAN_EXPORT(target, users);
+    NAN_EXPORT(target, bufferStats);
+    NAN_EXPORT(target, stats);
+    NAN_EXPORT(target, which);
+    NAN_EXPORT(target, commands);
+    NAN_EXPORT(target, rehash);
+    NAN_EXPORT(target, builtins);
+
+    {
+        auto cname = Nan::New("Environ").ToLocalChecked();
+        auto ctor = Nan::New<v8::FunctionTemplate>(environment::New);
+        auto ctorInst = ctor->InstanceTemplate();
+        ctor->SetClassName(cname);
+        ctorInst->SetInternalFieldCount(1);
+        environment::NanEnviron::constructor.Reset(ctor);
+
+        Nan::SetPrototypeMethod(ctor, "set", environment::Set);
+        Nan::SetPrototypeMethod(ctor, "unset", environment::Unset);
+        Nan::SetPrototypeMethod(ctor, "get", environment::Get);
+        Nan::SetAccessor(ctorInst, Nan::New("version").ToLocalChecked(), environment::Version);
+
+        Nan::Set(target, cname, Nan::GetFunction(ctor).ToLocalChecked());
+    }
 
     {
         auto cname = Nan::New("Job").ToLocalChecked();
@@ -481,14 +1369,24 @@ NAN_MODULE_INIT(Initialize) {
         auto ctorInst = ctor->InstanceTemplate();
         ctor->SetClassName(cname);
         ctorInst->SetInternalFieldCount(1);
+        job::NanJob::constructor.Reset(ctor);
 
         Nan::SetPrototypeMethod(ctor, "add", job::Add);
         Nan::SetPrototypeMethod(ctor, "on", job::On);
         Nan::SetPrototypeMethod(ctor, "start", job::Start);
         Nan::SetPrototypeMethod(ctor, "write", job::Write);
         Nan::SetPrototypeMethod(ctor, "close", job::Close);
+        Nan::SetPrototypeMethod(ctor, "pipeTo", job::PipeTo);
+        Nan::SetPrototypeMethod(ctor, "pause", job::Pause);
+        Nan::SetPrototypeMethod(ctor, "resume", job::Resume);
+        Nan::SetPrototypeMethod(ctor, "setWatermarks", job::SetWatermarks);
+        Nan::SetPrototypeMethod(ctor, "setCoalesce", job::SetCoalesce);
+        Nan::SetPrototypeMethod(ctor, "setDelimiter", job::SetDelimiter);
+        Nan::SetPrototypeMethod(ctor, "setTimeout", job::SetTimeout);
+        Nan::SetAccessor(ctorInst, Nan::New("queuedBytes").ToLocalChecked(), job::QueuedBytes);
         Nan::SetPrototypeMethod(ctor, "setMode", job::SetMode);
         Nan::SetPrototypeMethod(ctor, "command", job::Command);
+        Nan::SetPrototypeMethod(ctor, "stats", job::Stats);
 
         auto ctorFunc = Nan::GetFunction(ctor).ToLocalChecked();
         Nan::Set(ctorFunc, Nan::New("Foreground").ToLocalChecked(), Nan::New<v8::Uint32>(Job::Foreground));
@@ -496,9 +1394,12 @@ NAN_MODULE_INIT(Initialize) {
         Nan::Set(ctorFunc, Nan::New("Stopped").ToLocalChecked(), Nan::New<v8::Uint32>(Job::Stopped));
         Nan::Set(ctorFunc, Nan::New("Terminated").ToLocalChecked(), Nan::New<v8::Uint32>(Job::Terminated));
         Nan::Set(ctorFunc, Nan::New("Failed").ToLocalChecked(), Nan::New<v8::Uint32>(Job::Failed));
+        Nan::Set(ctorFunc, Nan::New("TimedOut").ToLocalChecked(), Nan::New<v8::Uint32>(Job::TimedOut));
         Nan::Set(ctorFunc, Nan::New("DupStdin").ToLocalChecked(), Nan::New<v8::Uint32>(Job::DupStdin));
         Nan::Set(ctorFunc, Nan::New("DupStdout").ToLocalChecked(), Nan::New<v8::Uint32>(Job::DupStdout));
         Nan::Set(ctorFunc, Nan::New("DupStderr").ToLocalChecked(), Nan::New<v8::Uint32>(Job::DupStderr));
+        Nan::Set(ctorFunc, Nan::New("CaptureStdout").ToLocalChecked(), Nan::New<v8::Uint32>(Job::CaptureStdout));
+        Nan::Set(ctorFunc, Nan::New("CaptureTrimNewlines").ToLocalChecked(), Nan::New<v8::Uint32>(Job::CaptureTrimNewlines));
 
         Nan::Set(target, cname, Nan::GetFunction(ctor).ToLocalChecked());
     }